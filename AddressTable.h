@@ -0,0 +1,366 @@
+#ifndef _AddressTable_h
+#define _AddressTable_h
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Open-addressing hash table keyed by heap address.
+//
+// Keys are grouped eight to a cache-line-aligned bucket and probed
+// linearly bucket by bucket, values live in a parallel array.  All
+// memory comes straight from mmap() so that the table never calls back
+// into the hooked malloc.
+//
+// Growing never rehashes everything at once: the full array becomes
+// "old", a larger one becomes current, and every following insert or
+// erase moves ATMIGRATE old buckets over.  Lookups check both arrays
+// while a migration is in flight.
+//
+// Not thread safe, callers serialize access (see SMTShard).
+
+#define ATSLOTS 8
+#define ATMINBUCKETS 8
+#define ATMIGRATE 4
+
+template<typename Value>
+class AddressTable {
+public:
+    class iterator;
+
+    AddressTable()
+        : live(0)
+        , migrated(0)
+    {
+    }
+    ~AddressTable()
+    {
+        clear();
+    }
+
+    // Insert or overwrite p, copying an overwritten value to previous and
+    // setting replaced when given.  Returns false only when mmap() fails.
+    bool insert(void* p, const Value& v, Value* previous = 0, bool* replaced = 0)
+    {
+        if (replaced)
+            *replaced = false;
+        step();
+        if (!cur.buckets || (cur.used + 1) * 4 > cur.capacity() * 3) {
+            if (!grow())
+                return false;
+        }
+        if (old.buckets) {
+            size_t i = old.find(p);
+            if (i != (size_t)-1) {
+                if (previous)
+                    *previous = old.values[i];
+                if (replaced)
+                    *replaced = true;
+                old.values[i] = v;
+                return true;
+            }
+        }
+        bool added = false;
+        size_t i = cur.findorplace(p, added);
+        if (!added) {
+            if (previous)
+                *previous = cur.values[i];
+            if (replaced)
+                *replaced = true;
+        }
+        cur.values[i] = v;
+        if (added)
+            live++;
+        return true;
+    }
+
+    Value* find(void* p)
+    {
+        size_t i;
+        if (cur.buckets && (i = cur.find(p)) != (size_t)-1)
+            return &cur.values[i];
+        if (old.buckets && (i = old.find(p)) != (size_t)-1)
+            return &old.values[i];
+        return 0;
+    }
+
+    // Remove p, copying its value to out when given.
+    bool erase(void* p, Value* out = 0)
+    {
+        step();
+        if (cur.erase(p, out) || old.erase(p, out)) {
+            live--;
+            return true;
+        }
+        return false;
+    }
+
+    size_t size() const
+    {
+        return live;
+    }
+
+    bool empty() const
+    {
+        return !live;
+    }
+
+    void clear()
+    {
+        cur.release();
+        old.release();
+        live = 0;
+        migrated = 0;
+    }
+
+    // Walks the current array, then whatever is left in the old one.
+    class iterator {
+    public:
+        iterator()
+            : table(0)
+            , array(2)
+            , index(0)
+        {
+        }
+        iterator(AddressTable* t, int a, size_t i)
+            : table(t)
+            , array(a)
+            , index(i)
+        {
+            settle();
+        }
+        void* key() const
+        {
+            return arr()->key(index);
+        }
+        Value& value() const
+        {
+            return arr()->values[index];
+        }
+        iterator& operator++()
+        {
+            index++;
+            settle();
+            return *this;
+        }
+        bool operator!=(const iterator& o) const
+        {
+            return array != o.array || index != o.index;
+        }
+    private:
+        typename AddressTable::Array* arr() const
+        {
+            return array ? &table->old : &table->cur;
+        }
+        void settle()
+        {
+            while (array < 2) {
+                typename AddressTable::Array* a = arr();
+                for (; index < a->capacity(); index++) {
+                    void* k = a->key(index);
+                    if (k != EMPTY && k != TOMBSTONE)
+                        return;
+                }
+                array++;
+                index = 0;
+            }
+        }
+        AddressTable* table;
+        int array;
+        size_t index;
+    };
+
+    iterator begin()
+    {
+        return iterator(this, 0, 0);
+    }
+    iterator end()
+    {
+        return iterator(this, 2, 0);
+    }
+
+private:
+    AddressTable(const AddressTable&);
+    void operator=(const AddressTable&);
+
+    static void* const EMPTY;
+    static void* const TOMBSTONE;
+
+    class Bucket {
+    public:
+        void* keys[ATSLOTS];
+    } __attribute__((aligned(64)));
+
+    class Array {
+    public:
+        Array()
+            : buckets(0)
+            , values(0)
+            , nbuckets(0)
+            , shift(0)
+            , used(0)
+        {
+        }
+        size_t capacity() const
+        {
+            return nbuckets * ATSLOTS;
+        }
+        void* key(size_t i) const
+        {
+            return buckets[i / ATSLOTS].keys[i % ATSLOTS];
+        }
+        size_t home(void* p) const
+        {
+            uint64_t h = (reinterpret_cast<uintptr_t>(p) >> 4) * 0x9E3779B97F4A7C15ULL;
+            return h >> shift;
+        }
+        bool allocate(size_t n)
+        {
+            void* b = mmap(0, n * sizeof(Bucket), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (b == MAP_FAILED)
+                return false;
+            void* v = mmap(0, n * ATSLOTS * sizeof(Value), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (v == MAP_FAILED) {
+                munmap(b, n * sizeof(Bucket));
+                return false;
+            }
+            buckets = static_cast<Bucket*>(b);
+            values = static_cast<Value*>(v);
+            nbuckets = n;
+            shift = 64;
+            for (; n > 1; n >>= 1)
+                shift--;
+            used = 0;
+            return true;
+        }
+        void release()
+        {
+            if (buckets) {
+                munmap(buckets, nbuckets * sizeof(Bucket));
+                munmap(values, nbuckets * ATSLOTS * sizeof(Value));
+            }
+            buckets = 0;
+            values = 0;
+            nbuckets = 0;
+            used = 0;
+        }
+        size_t find(void* p) const
+        {
+            if (!buckets)
+                return -1;
+            size_t b = home(p);
+            for (size_t n = 0; n < nbuckets; n++) {
+                const Bucket& bucket = buckets[b];
+                for (size_t s = 0; s < ATSLOTS; s++) {
+                    if (bucket.keys[s] == p)
+                        return b * ATSLOTS + s;
+                    if (bucket.keys[s] == EMPTY)
+                        return -1;
+                }
+                b = (b + 1) & (nbuckets - 1);
+            }
+            return -1;
+        }
+        // slot holding p, or the first reusable slot on its probe path
+        size_t findorplace(void* p, bool& added)
+        {
+            size_t b = home(p);
+            size_t reuse = -1;
+            for (size_t n = 0; n < nbuckets; n++) {
+                Bucket& bucket = buckets[b];
+                for (size_t s = 0; s < ATSLOTS; s++) {
+                    void* k = bucket.keys[s];
+                    if (k == p) {
+                        added = false;
+                        return b * ATSLOTS + s;
+                    }
+                    if (k == TOMBSTONE && reuse == (size_t)-1)
+                        reuse = b * ATSLOTS + s;
+                    if (k == EMPTY) {
+                        if (reuse == (size_t)-1) {
+                            reuse = b * ATSLOTS + s;
+                            used++;
+                        }
+                        goto place;
+                    }
+                }
+                b = (b + 1) & (nbuckets - 1);
+            }
+        place:
+            buckets[reuse / ATSLOTS].keys[reuse % ATSLOTS] = p;
+            added = true;
+            return reuse;
+        }
+        bool erase(void* p, Value* out)
+        {
+            size_t i = find(p);
+            if (i == (size_t)-1)
+                return false;
+            if (out)
+                *out = values[i];
+            buckets[i / ATSLOTS].keys[i % ATSLOTS] = TOMBSTONE;
+            return true;
+        }
+        Bucket* buckets;
+        Value* values;
+        size_t nbuckets; // power of two
+        int shift; // 64 - log2(nbuckets), home() keeps the top hash bits
+        size_t used; // live slots plus tombstones
+    };
+
+    // Start a new current array.  An unfinished migration is completed
+    // first, which only happens if inserts outpace ATMIGRATE badly.
+    bool grow()
+    {
+        while (old.buckets)
+            migrate(old.nbuckets);
+        size_t n = ATMINBUCKETS;
+        while (n * ATSLOTS < live * 4)
+            n <<= 1;
+        Array next;
+        if (!next.allocate(n))
+            return false;
+        old = cur;
+        cur = next;
+        migrated = 0;
+        if (!old.buckets || !live)
+            old.release();
+        return true;
+    }
+
+    void migrate(size_t n)
+    {
+        for (; n && migrated < old.nbuckets; n--, migrated++) {
+            Bucket& bucket = old.buckets[migrated];
+            for (size_t s = 0; s < ATSLOTS; s++) {
+                void* k = bucket.keys[s];
+                if (k == EMPTY || k == TOMBSTONE)
+                    continue;
+                bool added = false;
+                size_t i = cur.findorplace(k, added);
+                cur.values[i] = old.values[migrated * ATSLOTS + s];
+                bucket.keys[s] = TOMBSTONE;
+            }
+        }
+        if (migrated == old.nbuckets) {
+            old.release();
+            migrated = 0;
+        }
+    }
+
+    void step()
+    {
+        if (old.buckets)
+            migrate(ATMIGRATE);
+    }
+
+    Array cur;
+    Array old;
+    size_t live;
+    size_t migrated;
+};
+
+template<typename Value> void* const AddressTable<Value>::EMPTY = 0;
+template<typename Value> void* const AddressTable<Value>::TOMBSTONE = reinterpret_cast<void*>(1);
+
+#endif // _AddressTable_h
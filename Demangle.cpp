@@ -36,7 +36,13 @@
 
 #include "Demangle.h"
 
+#include <cxxabi.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>  // for NULL
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 namespace WTF {
 
@@ -1302,4 +1308,202 @@ bool Demangle(const char *mangled, char *out, int out_size) {
   return ParseTopLevelMangledName(&state) && !state.overflowed;
 }
 
+// Memoized demangling.
+//
+// Results are hash-consed by mangled name into a fixed array of bucket
+// chains and never removed, so the returned strings stay valid for the
+// life of the process and are shared by every caller.  Entries are
+// carved out of mmap'd chunks; the cache itself never calls malloc().
+// Lookups walk a chain without any lock, inserts take the arena lock.
+//
+// A zero-filled DemangleCache is a valid empty cache.
+
+static const int kDemangleCacheBuckets = 1 << 14;
+static const size_t kDemangleCacheChunkSize = 1 << 16;
+
+enum DemangleKind {
+  kDemangleShort,  // Demangle()
+  kDemangleFull    // abi::__cxa_demangle()
+};
+
+struct CachedName {
+  CachedName *next;
+  uint32_t hash;
+  int kind;
+  const char *demangled;  // NULL if the name cannot be demangled.
+  char mangled[1];
+};
+
+struct DemangleCache {
+  CachedName *buckets[kDemangleCacheBuckets];
+  int lock;
+  char *chunk;
+  size_t chunk_used;
+};
+
+static DemangleCache demangle_cache;
+
+static uint32_t HashName(const char *str, int kind) {
+  uint32_t h = 2166136261u ^ kind;
+  for (; *str != '\0'; ++str) {
+    h ^= static_cast<unsigned char>(*str);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void *MapAnonymous(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Caller holds demangle_cache.lock.  Entries bigger than a chunk get a
+// mapping of their own.
+static char *AllocateFromCache(size_t size) {
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (size > kDemangleCacheChunkSize) {
+    return static_cast<char *>(MapAnonymous(size));
+  }
+  DemangleCache &cache = demangle_cache;
+  if (cache.chunk == NULL ||
+      cache.chunk_used + size > kDemangleCacheChunkSize) {
+    cache.chunk = static_cast<char *>(MapAnonymous(kDemangleCacheChunkSize));
+    cache.chunk_used = 0;
+    if (cache.chunk == NULL) {
+      return NULL;
+    }
+  }
+  char *p = cache.chunk + cache.chunk_used;
+  cache.chunk_used += size;
+  return p;
+}
+
+static const CachedName *FindCachedName(const CachedName *head, uint32_t hash,
+                                        int kind, const char *mangled) {
+  for (; head != NULL; head = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE)) {
+    if (head->hash == hash && head->kind == kind &&
+        strcmp(head->mangled, mangled) == 0) {
+      return head;
+    }
+  }
+  return NULL;
+}
+
+// Demangle() into a buffer that grows until the result fits.  Returns
+// the result in "*out", which the caller unmaps when it is not "buf",
+// or false if "mangled" cannot be demangled.
+static bool DemangleUnbounded(const char *mangled, char *buf, size_t buf_size,
+                              char **out, size_t *out_size) {
+  char *cur = buf;
+  size_t size = buf_size;
+  for (;;) {
+    State state;
+    InitState(&state, mangled, cur, size);
+    bool parsed = ParseTopLevelMangledName(&state);
+    if (!state.overflowed) {
+      if (parsed) {
+        *out = cur;
+        *out_size = size;
+        return true;
+      }
+      break;
+    }
+    if (cur != buf) {
+      munmap(cur, size);
+    }
+    size *= 2;
+    cur = static_cast<char *>(MapAnonymous(size));
+    if (cur == NULL) {
+      return false;
+    }
+  }
+  if (cur != buf) {
+    munmap(cur, size);
+  }
+  return false;
+}
+
+static const char *DemangleWithCache(const char *mangled, int kind) {
+  DemangleCache &cache = demangle_cache;
+  uint32_t hash = HashName(mangled, kind);
+  CachedName **bucket = &cache.buckets[hash & (kDemangleCacheBuckets - 1)];
+  const CachedName *found =
+      FindCachedName(__atomic_load_n(bucket, __ATOMIC_ACQUIRE), hash, kind,
+                     mangled);
+  if (found != NULL) {
+    return found->demangled;
+  }
+
+  // Demangle outside the lock, a racing thread may do the same work.
+  char buf[256];
+  char *demangled = NULL;
+  size_t demangled_size = 0;
+  bool mapped = false;
+  bool allocated = false;
+  if (kind == kDemangleShort) {
+    if (DemangleUnbounded(mangled, buf, sizeof(buf), &demangled,
+                          &demangled_size)) {
+      mapped = demangled != buf;
+    } else {
+      demangled = NULL;
+    }
+  } else {
+    int status = 0;
+    demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+    allocated = demangled != NULL;
+  }
+
+  size_t mangled_len = strlen(mangled);
+  size_t demangled_len = demangled != NULL ? strlen(demangled) : 0;
+  const char *result = NULL;
+  while (__atomic_exchange_n(&cache.lock, 1, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+  found = FindCachedName(*bucket, hash, kind, mangled);
+  if (found != NULL) {
+    result = found->demangled;
+  } else {
+    char *p = AllocateFromCache(sizeof(CachedName) + mangled_len +
+                                (demangled != NULL ? demangled_len + 1 : 0));
+    if (p != NULL) {
+      CachedName *entry = reinterpret_cast<CachedName *>(p);
+      entry->next = *bucket;
+      entry->hash = hash;
+      entry->kind = kind;
+      memcpy(entry->mangled, mangled, mangled_len + 1);
+      if (demangled != NULL) {
+        char *copy = entry->mangled + mangled_len + 1;
+        memcpy(copy, demangled, demangled_len + 1);
+        entry->demangled = copy;
+      } else {
+        entry->demangled = NULL;
+      }
+      __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+      result = entry->demangled;
+    }
+  }
+  __atomic_store_n(&cache.lock, 0, __ATOMIC_RELEASE);
+
+  if (mapped) {
+    munmap(demangled, demangled_size);
+  }
+  if (allocated) {
+    free(demangled);
+  }
+  return result;
+}
+
+const char *DemangleCached(const char *mangled) {
+  return DemangleWithCache(mangled, kDemangleShort);
+}
+
+const char *CxaDemangleCached(const char *mangled) {
+  return DemangleWithCache(mangled, kDemangleFull);
+}
+
+void DemangleCacheAfterFork() {
+  demangle_cache.lock = 0;
+}
+
 }
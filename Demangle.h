@@ -77,6 +77,20 @@ namespace WTF {
 // "out" is modified even if demangling is unsuccessful.
 bool Demangle(const char *mangled, char *out, int out_size);
 
+// Like Demangle(), but without a limit on the length of the result and
+// memoized: each distinct "mangled" is demangled once per process.
+// Returns NULL if "mangled" cannot be demangled.  The returned string is
+// never freed.  Not async signal safe, since it may wait for another
+// thread filling the cache.
+const char *DemangleCached(const char *mangled);
+
+// Same, with abi::__cxa_demangle(), which also prints parameter and
+// template argument types.  Calls malloc() on a miss.
+const char *CxaDemangleCached(const char *mangled);
+
+// Reset the cache's lock in the child after fork().
+void DemangleCacheAfterFork();
+
 }
 
 #endif  // DEMANGLE_H_
@@ -0,0 +1,70 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "FrameUnwind.h"
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#define HAVE_FRAME_LAYOUT 1
+#endif
+
+// highest address of this thread's stack, 1 when it is unknown
+static __thread uintptr_t stacktop = 0;
+
+static uintptr_t getstacktop()
+{
+    if (!stacktop) {
+        pthread_attr_t attr;
+        void* addr = 0;
+        size_t size = 0;
+        stacktop = 1;
+        if (!pthread_getattr_np(pthread_self(), &attr)) {
+            if (!pthread_attr_getstack(&attr, &addr, &size))
+                stacktop = reinterpret_cast<uintptr_t>(addr) + size;
+            pthread_attr_destroy(&attr);
+        }
+    }
+    return stacktop;
+}
+
+int __attribute__((noinline)) fpbacktrace(void** buffer, int size)
+{
+#if HAVE_FRAME_LAYOUT
+    uintptr_t top = getstacktop();
+    if (top != 1) {
+        // frame layout on supported targets: fp[0] saved fp, fp[1] return address
+        uintptr_t* fp = static_cast<uintptr_t*>(__builtin_frame_address(0));
+        uintptr_t bottom = reinterpret_cast<uintptr_t>(fp);
+        int n = 0;
+        while (n < size) {
+            uintptr_t cur = reinterpret_cast<uintptr_t>(fp);
+            if (cur < bottom || cur + 2 * sizeof(uintptr_t) > top || (cur & (sizeof(uintptr_t) - 1)))
+                break;
+            uintptr_t pc = fp[1];
+            if (!pc)
+                break;
+            buffer[n++] = reinterpret_cast<void*>(pc);
+            uintptr_t* next = reinterpret_cast<uintptr_t*>(fp[0]);
+            // caller frames sit strictly higher on a downward growing stack
+            if (next <= fp)
+                break;
+            fp = next;
+        }
+        return n;
+    }
+#endif
+    // backtrace() right here rather than in a helper, which could be
+    // tail called and leave no frame of ours to drop: frames[0] is in
+    // fpbacktrace(), frames[1] in its caller like buffer[0] above
+    void* frames[size + 1];
+    int n = backtrace(frames, size + 1);
+    if (n <= 1)
+        return 0;
+    memcpy(buffer, frames + 1, (n - 1) * sizeof(void*));
+    return n - 1;
+}
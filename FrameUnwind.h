@@ -0,0 +1,14 @@
+#ifndef _FrameUnwind_h
+#define _FrameUnwind_h
+
+// Fast replacement for glibc backtrace() that follows the saved frame
+// pointer chain.  Every frame pointer is checked against the current
+// thread's stack range before it is read, so code built without frame
+// pointers only ends the walk early instead of faulting.  Like
+// backtrace(), buffer[0] is the return address into the caller.
+//
+// Falls back to backtrace() where the frame layout is unknown or the
+// thread's stack range cannot be determined.
+int fpbacktrace(void** buffer, int size);
+
+#endif // _FrameUnwind_h
@@ -2,22 +2,37 @@
 #define _GNU_SOURCE
 #endif 
 
+#include "AddressTable.h"
+#include "Demangle.h"
+#include "FrameUnwind.h"
+#include "StackDepot.h"
 #include "Symbolize.h"
 
-#include <cxxabi.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <execinfo.h>
+#include <math.h>
 #include <map>
+#include <new>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "SimpleMallocTrace.h"
 
@@ -30,12 +45,18 @@ extern "C" {
 
 #define PATH_MAX 256
 #define BTSZ 10
-#define BTAL 20
+#define SMTMAXDEPTH 64
 #define COLOR_NONE "\033[0;0m"
 #define COLOR_RED "\033[5;31m"
 #define COLOR_GREEN "\033[0;42m"
 #define COLOR_YELLOW "\033[0;33m"
-#define SMTLOG(...) printf(__VA_ARGS__)
+#define SMTLOG(...) fprintf(stderr, __VA_ARGS__)
+
+// build with -DSMT_FP_UNWINDER=1 to walk frame pointers by default,
+// SMT_UNWINDER=fp or SMT_UNWINDER=backtrace in the environment overrides
+#ifndef SMT_FP_UNWINDER
+#define SMT_FP_UNWINDER 0
+#endif
 
 typedef void * (*MALLOC_FUNCTION) (size_t);
 typedef void * (*CALLOC_FUNCTION) (size_t, size_t);
@@ -67,27 +88,213 @@ static const char* aligned_alloc_symbol = "aligned_alloc";
 static const char* memalign_symbol = "memalign";
 static const char* cfree_symbol = "cfree";
 
+#define SMTSHARDS 64
+#define SMTCACHELINE 64
+#define SMTRINGSZ 4096
+#define SMTDRAINUS 1000
+#define SMTLOCALSZ 64
+#define SMTLOCALBUCKETS 65536
+#define SMTREPORTWORKERS 16
+#define SMTREPORTBATCH 256
+#define SMTSNAPSHOTDEPTH 5
+#define SMTRATETOP 50
+#define SMTSIZECLASSES 65
+#define SMTSIZEPAGESHIFT 8
+#define SMTSIZEPAGES ((SDPAGES << SDPAGESHIFT) >> SMTSIZEPAGESHIFT)
+#define SMTSIZETOP 50
+#define SMTLIFETIMECLASSES 11
+
+// allocation hooks, for the size histograms
+#define SMTHOOKMALLOC 0
+#define SMTHOOKCALLOC 1
+#define SMTHOOKREALLOC 2
+#define SMTHOOKPOSIXMEMALIGN 3
+#define SMTHOOKALIGNEDALLOC 4
+#define SMTHOOKMEMALIGN 5
+#define SMTHOOKNEW 6
+#define SMTHOOKNEWARRAY 7
+#define SMTHOOKS 8
+
+// how a block was allocated, each must be freed its own way
+#define SMTKINDMALLOC 0
+#define SMTKINDNEW 1
+#define SMTKINDNEWARRAY 2
+#define SMTKINDNEWALIGNED 3
+#define SMTKINDNEWARRAYALIGNED 4
+#define SMTMISMATCHES 1024
+
+// protects smtmaplist, only taken by smtstart()/smtstop()
 pthread_mutex_t maplock;
+
+// test-and-set lock, cheap enough to take on every malloc/free
+class SMTSpinLock {
+public:
+    SMTSpinLock()
+        : locked(0)
+    {
+    }
+    void lock()
+    {
+        int spins = 0;
+        while (__atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked, __ATOMIC_RELAXED)) {
+                if (++spins > 100) {
+                    sched_yield();
+                    spins = 0;
+                }
+            }
+        }
+    }
+    void unlock()
+    {
+        __atomic_store_n(&locked, 0, __ATOMIC_RELEASE);
+    }
+private:
+    int locked;
+};
+
+// backtraces of every allocation
+static StackDepot smtdepot;
+
 class MallocNode {
 public:
     MallocNode()
         : sz(0)
+        , stackid(0)
+        , kind(SMTKINDMALLOC)
+        , epoch(0)
+        , time(0)
     {
-        memset(bt, 0x0, sizeof(bt));
     }
-    MallocNode(size_t _sz, void* _bt[], size_t len)
+    MallocNode(size_t _sz, uint32_t _stackid, uint32_t _epoch, uint64_t _time, int _kind)
         : sz(_sz)
+        , stackid(_stackid)
+        , kind(_kind)
+        , epoch(_epoch)
+        , time(_time)
     {
-        memset(bt, 0x0, sizeof(bt));
-        size_t sz = len <= BTSZ ? len : BTSZ;
-        memcpy(bt, _bt, sz*sizeof(void*));
     }
 public:
     size_t sz;
-    void* bt[BTSZ];
+    // stack ids stay below SDPAGES << SDPAGESHIFT, which leaves room for
+    // the kind without growing the node
+    uint32_t stackid : 29;
+    // SMTKIND*, checked against the function that frees the block
+    uint32_t kind : 3;
+    // value of smtepoch when allocated, see SMTMap
+    uint32_t epoch;
+    // smtclock() when allocated, 0 unless SMT_LIFETIMES is on
+    uint64_t time;
+};
+
+typedef AddressTable<MallocNode> MMap;
+
+// SMT_SNAPSHOT_INTERVAL=<seconds> charges every tracked block to the
+// live counters of its stack in smtdepot, see smtsnapshot()
+static int smtstackcounters = 0;
+
+// SMT_RATES=1 counts allocations, bytes and frees per stack, see SMTRateTable
+static int smtrates = 0;
+static void smtcountfree(uint32_t stackid);
+
+// SMT_SIZES=1 keeps histograms of requested sizes, see SMTHistogramTable
+static int smtsizes = 0;
+// SMT_LIFETIMES=1 keeps histograms of how long blocks live, see smtclock()
+static int smtlifetimes = 0;
+static void smtcountlifetime(uint32_t stackid, uint64_t allocated, uint64_t freed);
+
+// blocks freed by a function that does not match how they were allocated
+static int smtmismatched(int allocated, size_t allocatedsz, int freed, size_t freedsz);
+static void smtmismatch(uint32_t stackid, int allocated, int freed, int wrongsize, uint32_t freestackid);
+
+// one stripe of the live table, padded so that neighbouring locks
+// never share a cache line
+class SMTShard {
+public:
+    SMTSpinLock lock;
+    MMap mmap;
+} __attribute__((aligned(SMTCACHELINE)));
+
+// live allocation table split into SMTSHARDS shards by address hash,
+// so threads touching different addresses rarely wait on each other
+class SMTTable {
+public:
+    static size_t shardof(void* p)
+    {
+        uintptr_t k = reinterpret_cast<uintptr_t>(p) >> 4;
+        k *= 0x9E3779B97F4A7C15ULL;
+        return (k >> 32) % SMTSHARDS;
+    }
+    void insert(void* p, size_t sz, uint32_t stackid, uint32_t epoch, uint64_t time, int kind)
+    {
+        SMTShard& shard = shards[shardof(p)];
+        MallocNode previous;
+        bool replaced = false;
+        shard.lock.lock();
+        shard.mmap.insert(p, MallocNode(sz, stackid, epoch, time, kind), &previous, &replaced);
+        shard.lock.unlock();
+        if (__atomic_load_n(&smtstackcounters, __ATOMIC_RELAXED)) {
+            if (replaced)
+                smtdepot.account(previous.stackid, -1, -(intptr_t)previous.sz);
+            smtdepot.account(stackid, 1, sz);
+        }
+    }
+    // time is when p was freed, by smtclock().  Sets *node to what p
+    // was, for the caller to check how it is freed.
+    bool erase(void* p, uint64_t time, MallocNode* node)
+    {
+        SMTShard& shard = shards[shardof(p)];
+        shard.lock.lock();
+        bool erased = shard.mmap.erase(p, node);
+        shard.lock.unlock();
+        if (!erased)
+            return false;
+        if (__atomic_load_n(&smtstackcounters, __ATOMIC_RELAXED))
+            smtdepot.account(node->stackid, -1, -(intptr_t)node->sz);
+        if (smtrates)
+            smtcountfree(node->stackid);
+        if (smtlifetimes)
+            smtcountlifetime(node->stackid, node->time, time);
+        return true;
+    }
+    // every shard, in order, so that fork() copies a consistent table
+    void lockall()
+    {
+        for (size_t i = 0; i < SMTSHARDS; i++)
+            shards[i].lock.lock();
+    }
+    void unlockall()
+    {
+        for (size_t i = 0; i < SMTSHARDS; i++)
+            shards[i].lock.unlock();
+    }
+    // live entries allocated at or after epoch
+    size_t count(uint32_t epoch)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < SMTSHARDS; i++) {
+            shards[i].lock.lock();
+            if (!epoch) {
+                n += shards[i].mmap.size();
+            } else {
+                MMap::iterator it;
+                for (it = shards[i].mmap.begin(); it != shards[i].mmap.end(); ++it) {
+                    if (it.value().epoch >= epoch)
+                        n++;
+                }
+            }
+            shards[i].lock.unlock();
+        }
+        return n;
+    }
+    SMTShard shards[SMTSHARDS];
 };
 
-typedef std::map<void*, MallocNode> MMap;
+// A smtstart()/smtstop() scope.  Scopes have no table of their own:
+// smtstart() bumps smtepoch, every allocation is stamped with the epoch
+// it happened in, and the scope's leaks are the live entries of
+// smttable stamped at or after startepoch.  So a malloc costs the same
+// whatever the number of open scopes.
 class SMTMap {
 public:
     SMTMap()
@@ -106,20 +313,14 @@ public:
         stopfunction[3] = 'n';
         stopfunction[4] = '\0';
         stopline = -1;
+        startepoch = 0;
     }
-    SMTMap(const char* file, const char* function, size_t line)
+    SMTMap(const char* file, const char* function, size_t line, uint32_t epoch)
     {
         snprintf(startfile, sizeof(stopfile), "%s", file);
         snprintf(startfunction, sizeof(stopfunction), "%s", function);
         startline = line;
-    }
-    void insert(void* p, size_t sz, void** bt, size_t len)
-    {
-        mmap.insert(std::pair<void*, MallocNode>(p, MallocNode(sz, bt, len)));
-    }
-    void erase(void* p)
-    {
-        mmap.erase(p);
+        startepoch = epoch;
     }
     void stopAt(const char* file, const char* function, size_t line)
     {
@@ -133,29 +334,304 @@ public:
     char stopfile[PATH_MAX];
     char stopfunction[PATH_MAX];
     size_t stopline;
-    MMap mmap;
+    uint32_t startepoch;
 };
 
+// the live table, allocations are tracked once it exists
+static SMTTable* smttable = 0;
+static uint32_t smtepoch = 0;
+// in a forked child, the first epoch of its own: entries stamped before
+// it were inherited from the parent, whose pid is smtparentpid
+static uint32_t smtforkepoch = 0;
+static pid_t smtparentpid = 0;
+static pid_t smtforkingpid = 0;
 static std::vector<SMTMap*>* smtmaplist = 0;
 static sem_t smtinit_sem;
 
-static void detectmemoryleak(SMTMap*);
-static char* getlogpath(SMTMap*);
+// One alloc ('+') or free ('-') event waiting to be applied to smttable.
+// seq comes from a single process-wide counter: a free of p is always
+// stamped after the alloc that produced p, even when the two happen on
+// different threads, so applying records in seq order is exact.
+class SMTRecord {
+public:
+    uint64_t seq;
+    void* p;
+    size_t sz;
+    uint32_t stackid;
+    uint32_t epoch;
+    // when the alloc or free happened, see MallocNode::time
+    uint64_t time;
+    char c;
+    // SMTKIND* of the alloc or free, sz of a free is what a sized delete
+    // passed, 0 otherwise
+    char kind;
+};
+
+// Single-producer/single-consumer ring owned by one thread.  The owner
+// only writes tail, the draining thread only writes head.
+class SMTRing {
+public:
+    size_t head __attribute__((aligned(SMTCACHELINE)));
+    size_t tail __attribute__((aligned(SMTCACHELINE)));
+    int dead;
+    SMTRing* next;
+    SMTRecord records[SMTRINGSZ];
+};
+
+// How realloc() forgot p before calling libc, so that a failed realloc()
+// can track p again.  node is what was erased when found, otherwise with
+// SMT_ASYNC=1 the free only took seq, a hole no record is applied past
+// until smtrealloced() fills it.
+class SMTRealloc {
+public:
+    SMTRealloc()
+        : found(0)
+        , reserved(0)
+        , seq(0)
+    {
+    }
+public:
+    MallocNode node;
+    int found;
+    int reserved;
+    uint64_t seq;
+};
+
+// A tracked allocation its thread has not published to smttable yet.
+// p is 0 for an empty entry and p|1 while someone publishes it.
+class SMTLocalEntry {
+public:
+    void* p;
+    size_t sz;
+    uint32_t stackid : 29;
+    uint32_t kind : 3;
+    uint32_t epoch;
+    uint64_t time;
+};
+
+// Per-thread cache of recent allocations, direct mapped by address.  An
+// allocation freed while still cached never reaches smttable; one that
+// is evicted, flushed or left behind at thread exit is published then.
+// A free from any thread first cancels p in whichever cache holds it,
+// claiming entries with a CAS so that cancel and publish never both win.
+// Only a free that misses its own cache while smtlocalheld says some
+// cache holds an address like p looks at the other threads' caches.
+class SMTLocalCache {
+public:
+    SMTLocalEntry entries[SMTLOCALSZ];
+    int dead;
+    SMTLocalCache* next;
+};
+
+// SMT_ASYNC=1 in the environment makes tr_where() only push records to
+// the calling thread's ring; smtaggregator() applies them in batches.
+static int smtasync = 0;
+static int smtfpunwind = SMT_FP_UNWINDER;
+
+// SMT_DEPTH=<n> keeps n frames per allocation stack, at most SMTMAXDEPTH,
+// not counting tr_where() and the hook
+static int smtdepth = BTSZ - 2;
+
+// SMT_SAMPLE_INTERVAL=<bytes> tracks a Poisson sample of allocations,
+// one every <bytes> allocated on average, so an allocation of sz bytes
+// is picked with probability 1 - exp(-sz / interval).  Reports divide
+// by that probability to estimate the real counts and bytes.
+static size_t smtsampleinterval = 0;
+static __thread intptr_t smtsamplebytes = 0;
+static __thread uint64_t smtsampleseed = 0;
+static uint64_t smtseq = 0;
+static uint64_t smtapplied = 0;
+static SMTRing* smtrings = 0;
+static __thread SMTRing* smtring = 0;
+static pthread_key_t smtringkey;
+static pthread_mutex_t ringlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drainlock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<SMTRecord>* smtstaging = 0;
+static pthread_t smtaggregatorthread;
+static int smtaggregatorrunning = 0;
+static int smtaggregatorstop = 0;
+static sem_t smtaggregatorsem;
+// SMT_LOCAL_CACHE=0 in the environment publishes every event right away
+static int smtlocal = 0;
+static SMTLocalCache* smtlocalcaches = 0;
+// cached entries of every thread per bucket of addresses, see
+// smtlocalbucket().  A block freed on another thread, or long after its
+// cache let it go, mostly finds its bucket at 0 and goes to smttable
+// without a scan of every cache.
+static uint32_t smtlocalheld[SMTLOCALBUCKETS];
+static __thread SMTLocalCache* smtlocalcache = 0;
+static pthread_key_t smtlocalkey;
+static pthread_mutex_t locallock = PTHREAD_MUTEX_INITIALIZER;
+// SMT_DUMP_SIGNAL=<signo> (none by default, the program's signals are
+// its own) makes the handler set smtdumprequested and wake smtdumper(),
+// which writes the live heap profile outside of signal context
+static int smtdumprequested = 0;
+// A forked child wants smtdumper() again.  pthread_create() takes libc
+// locks and allocates, neither the fork handler nor a hook, which may run
+// under any lock of the program, can start it: the child's first
+// smtstart() or smtstop() does.  A dump requested before then waits in
+// smtdumpsem.
+static int smtdumperwanted = 0;
+static int smtdumperrunning = 0;
+static int smtdumperstop = 0;
+static pthread_t smtdumperthread;
+static sem_t smtdumpsem;
+// serializes leak reports and heap dumps, which share smtframes and
+// the symbolizers
+static pthread_mutex_t reportlock = PTHREAD_MUTEX_INITIALIZER;
+// SMT_SNAPSHOT_INTERVAL=<seconds> also wakes smtdumper() that often to
+// snapshot the per-stack live counters, SMT_SNAPSHOT_DEPTH=<k> snapshots
+// are kept and compared
+static int smtsnapshotinterval = 0;
+static size_t smtsnapshotdepth = SMTSNAPSHOTDEPTH;
+static size_t smtsnapshottaken = 0;
+
+static void detectmemoryleak(SMTTable*, SMTMap*);
+static char* getlogpath(const char*);
 static void malloc_hook();
 static void childafterfork();
+static void smtprefork();
+static void smtparentafterfork();
+static void smtstartaggregator();
+static void smtstopaggregator();
+static void smtstartdumper(int);
+static void smtsnapshot();
+static int smtstartdumperthread();
+static void smtstopdumper();
+static void smtstartrates();
+static void smtreportrates();
+static void smtratesafterfork();
+static void smtstartsizes();
+static void smtreportsizes(const char*);
+static void smthistogramsafterfork();
+static void smtstartlifetimes();
+static void smtreportlifetimes(const char*);
+static void smtreportmismatches();
+static void smtmismatchesafterfork();
+static void smtflush();
+static void smtdrain(int);
+static void smtringexit(void*);
+static int smtpublish(char, void*, size_t, uint32_t, uint32_t, uint64_t, int, MallocNode*);
+static void smtlocalflush();
+static void smtlocalexit(void*);
+
+// the bytes until the next sample point: exponentially distributed with
+// a mean of smtsampleinterval bytes, which makes the picks a Poisson
+// process over allocated bytes
+static intptr_t smtnextsample()
+{
+    // xorshift64*, 53 random bits give u in (0, 1]
+    smtsampleseed ^= smtsampleseed >> 12;
+    smtsampleseed ^= smtsampleseed << 25;
+    smtsampleseed ^= smtsampleseed >> 27;
+    double u = ((smtsampleseed * 0x2545F4914F6CDD1DULL >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (intptr_t)(-log(u) * smtsampleinterval) + 1;
+}
+
+// an allocation of sz bytes used up the countdown, or it is the first of
+// its thread
+static int smtpicksample(size_t sz)
+{
+    if (!smtsampleinterval) {
+        smtsamplebytes = 0;
+        return 1;
+    }
+    if (!smtsampleseed) {
+        // a forked child has the same thread locals as its parent and
+        // mostly the same time, the pid tells them apart; splitmix64's
+        // finalizer spreads the few bits that differ
+        uint64_t seed = reinterpret_cast<uintptr_t>(&smtsampleseed) ^ (uint64_t)time(0) ^ ((uint64_t)getpid() << 32);
+        seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+        seed ^= seed >> 31;
+        smtsampleseed = seed ? seed : 0x9E3779B97F4A7C15ULL;
+        // only starts the countdown: the first allocation is picked with
+        // the same probability as any other, as smtsampleweight() assumes
+        if ((smtsamplebytes = smtnextsample() - (intptr_t)sz) > 0)
+            return 0;
+    }
+    smtsamplebytes = smtnextsample();
+    return 1;
+}
+
+// whether an allocation of sz bytes is tracked, the common case is one
+// subtraction and one branch
+static inline int smtsample(size_t sz)
+{
+    if ((smtsamplebytes -= sz) > 0)
+        return 0;
+    return smtpicksample(sz);
+}
+
+// how many allocations of sz bytes one tracked allocation stands for
+static double smtsampleweight(size_t sz)
+{
+    if (!smtsampleinterval)
+        return 1;
+    return 1.0 / (1.0 - exp(-(double)(sz ? sz : 1) / smtsampleinterval));
+}
 
 // simplemalloctrace_initialize will be called before main()
 static void __attribute__((constructor)) simplemalloctrace_initialize()
 {
+    // before anything is tracked, so that every block is charged
+    const char* snapshotinterval = getenv("SMT_SNAPSHOT_INTERVAL");
+    if (snapshotinterval && atoi(snapshotinterval) > 0) {
+        smtsnapshotinterval = atoi(snapshotinterval);
+        __atomic_store_n(&smtstackcounters, 1, __ATOMIC_RELEASE);
+    }
+    const char* snapshotdepth = getenv("SMT_SNAPSHOT_DEPTH");
+    if (snapshotdepth && atoi(snapshotdepth) > 1)
+        smtsnapshotdepth = atoi(snapshotdepth);
     malloc_hook();
     if (pthread_mutex_init(&maplock, 0)) {
         SMTLOG("Mutex init failed!\n");
         exit(1);
     }
-    pthread_atfork(0, 0, childafterfork);
+    const char* unwinder = getenv("SMT_UNWINDER");
+    if (unwinder)
+        smtfpunwind = !strcmp(unwinder, "fp");
+    const char* depth = getenv("SMT_DEPTH");
+    if (depth && atoi(depth) > 0)
+        smtdepth = std::min(atoi(depth), SMTMAXDEPTH);
+    const char* interval = getenv("SMT_SAMPLE_INTERVAL");
+    if (interval && atol(interval) > 0)
+        smtsampleinterval = atol(interval);
+    const char* async = getenv("SMT_ASYNC");
+    if (async && atoi(async) > 0) {
+        if (pthread_key_create(&smtringkey, smtringexit)
+            || sem_init(&smtaggregatorsem, 0, 0)) {
+            SMTLOG("*** fail to init async event buffers\n");
+            exit(1);
+        }
+        use_origin_malloc = 1;
+        smtstaging = new std::vector<SMTRecord>();
+        use_origin_malloc = 0;
+        smtapplied = __atomic_load_n(&smtseq, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&smtasync, 1, __ATOMIC_RELEASE);
+        smtstartaggregator();
+    }
+    const char* local = getenv("SMT_LOCAL_CACHE");
+    if ((!local || atoi(local) > 0) && !pthread_key_create(&smtlocalkey, smtlocalexit))
+        __atomic_store_n(&smtlocal, 1, __ATOMIC_RELEASE);
+    const char* rates = getenv("SMT_RATES");
+    if (rates && atoi(rates) > 0)
+        smtstartrates();
+    const char* sizes = getenv("SMT_SIZES");
+    if (sizes && atoi(sizes) > 0)
+        smtstartsizes();
+    const char* lifetimes = getenv("SMT_LIFETIMES");
+    if (lifetimes && atoi(lifetimes) > 0)
+        smtstartlifetimes();
+    const char* dumpsignal = getenv("SMT_DUMP_SIGNAL");
+    int signo = dumpsignal ? atoi(dumpsignal) : 0;
+    if (signo > 0 || smtsnapshotinterval)
+        smtstartdumper(signo);
+    pthread_atfork(smtprefork, smtparentafterfork, childafterfork);
 }
 
-// avoid dead lock in backtrace()
+// avoid dead lock in backtrace(), still needed with SMT_UNWINDER=fp since
+// fpbacktrace() falls back to it
 // #0 0x424a84b8 in __lll_lock_wait () from /lib/libpthread.so.0
 // No symbol table info available.
 // #1 0x424a1a30 in pthread_mutex_lock () from /lib/libpthread.so.0
@@ -189,12 +665,21 @@ static void __attribute__((destructor)) simplemalloctrace_finalize()
     SMTLOG(COLOR_YELLOW"exit main function, let's check memory leak\n");
     pthread_mutex_destroy(&maplock);
     use_origin_malloc = 1;
+    smtstopdumper();
+    smtlocalflush();
+    smtflush();
+    smtreportrates();
+    smtreportmismatches();
+    // stop tracking; hooks still running elsewhere may hold the table,
+    // so it is left mapped
+    SMTTable* table = __atomic_exchange_n(&smttable, (SMTTable*)0, __ATOMIC_ACQ_REL);
+    smtstopaggregator();
     if (smtmaplist) {
         std::vector<SMTMap*>::iterator it;
         for (it = smtmaplist->begin(); it != smtmaplist->end(); ++it) {
             SMTMap* smtmap = *it;
             if (smtmap) {
-                detectmemoryleak(smtmap);
+                detectmemoryleak(table, smtmap);
                 delete smtmap;
                 smtmap = 0;
             }
@@ -204,6 +689,32 @@ static void __attribute__((destructor)) simplemalloctrace_finalize()
     }
 }
 
+// make the parent's table exact at the fork point, keep the aggregator
+// out of the staging queue and hold every shard while the child is
+// created, so that the child inherits a consistent table
+static void smtprefork()
+{
+    pthread_mutex_lock(&maplock);
+    if (__atomic_load_n(&smtasync, __ATOMIC_ACQUIRE)) {
+        smtflush();
+        pthread_mutex_lock(&drainlock);
+    }
+    SMTTable* table = __atomic_load_n(&smttable, __ATOMIC_ACQUIRE);
+    if (table)
+        table->lockall();
+    smtforkingpid = getpid();
+}
+
+static void smtparentafterfork()
+{
+    SMTTable* table = __atomic_load_n(&smttable, __ATOMIC_ACQUIRE);
+    if (table)
+        table->unlockall();
+    if (__atomic_load_n(&smtasync, __ATOMIC_ACQUIRE))
+        pthread_mutex_unlock(&drainlock);
+    pthread_mutex_unlock(&maplock);
+}
+
 static void childafterfork()
 {
     SMTLOG("In a forked child, let's clean mmap and mutex\n");
@@ -214,18 +725,68 @@ static void childafterfork()
         exit(1);
     }
     use_origin_malloc = 1;
-    smtmaplist = new std::vector<SMTMap*>();
-    if (!smtmaplist) {
-        SMTLOG("fail to new mmap\n");
-        exit(1);
+    smtdepot.afterfork();
+    WTF::DemangleCacheAfterFork();
+    // do not draw the same samples as the parent: the next allocation
+    // reseeds and starts a countdown of the child's own
+    smtsampleseed = 0;
+    smtsamplebytes = 0;
+    // The child keeps the parent's table as fork() copied it, pages are
+    // only copied as the child writes them.  Whatever was allocated until
+    // now is marked inherited by epoch alone, without touching an entry.
+    SMTTable* table = __atomic_load_n(&smttable, __ATOMIC_ACQUIRE);
+    if (table)
+        table->unlockall();
+    smtparentpid = smtforkingpid;
+    smtforkepoch = __atomic_add_fetch(&smtepoch, 1, __ATOMIC_ACQ_REL);
+    if (smtasync) {
+        // apply what other threads pushed after smtprefork(), skipping
+        // records they never finished, their threads do not exist here
+        pthread_mutex_init(&ringlock, 0);
+        pthread_mutex_init(&drainlock, 0);
+        smtdrain(1);
+        smtstaging->clear();
+        smtapplied = smtseq;
+        for (SMTRing* ring = smtrings; ring; ring = ring->next) {
+            if (ring != smtring)
+                ring->dead = 1;
+        }
+        smtaggregatorrunning = 0;
+        smtstartaggregator();
     }
-    SMTMap* globalmap = new SMTMap("before main()", "main()", 0);
-    if (globalmap) {
-        globalmap->stopAt("after main()", "main()", 0);
-        smtmaplist->push_back(globalmap);
+    // and publish what their caches still hold
+    pthread_mutex_init(&locallock, 0);
+    smtlocalflush();
+    for (SMTLocalCache* cache = smtlocalcaches; cache; cache = cache->next) {
+        // an entry still busy was being published by a thread that does
+        // not exist here, publish it again: insert() replaces p if it got
+        // to the table, and no free erased p while its entry was busy
+        for (size_t i = 0; i < SMTLOCALSZ; i++) {
+            SMTLocalEntry& e = cache->entries[i];
+            uintptr_t k = reinterpret_cast<uintptr_t>(e.p);
+            if (k & 1)
+                smtpublish('+', reinterpret_cast<void*>(k & ~(uintptr_t)1), e.sz, e.stackid, e.epoch, e.time, e.kind, 0);
+        }
+        memset(cache->entries, 0, sizeof(cache->entries));
+        if (cache != smtlocalcache)
+            cache->dead = 1;
+    }
+    memset(smtlocalheld, 0, sizeof(smtlocalheld));
+    pthread_mutex_init(&reportlock, 0);
+    smtratesafterfork();
+    smthistogramsafterfork();
+    smtmismatchesafterfork();
+    smtsnapshottaken = 0;
+    if (smtdumperrunning || smtdumperwanted) {
+        // the handler is inherited, the thread it wakes is not; it is
+        // started again by the child's first smtstart() or smtstop()
+        smtdumperrunning = 0;
+        smtdumprequested = 0;
+        sem_init(&smtdumpsem, 0, 0);
+        __atomic_store_n(&smtdumperwanted, 1, __ATOMIC_RELEASE);
     }
     use_origin_malloc = 0;
-	SMTLOG("child process after fork callback done\n");
+    SMTLOG("child process after fork callback done\n");
 }
 
 static void malloc_hook()
@@ -288,12 +849,10 @@ static void malloc_hook()
             r = 1;
             break;
         }
+        // cfree() was removed from glibc 2.26, fall back to free()
         libc_cfree = (CFREE_FUNCTION)dlsym(RTLD_NEXT, cfree_symbol);
-        if (!libc_cfree) {
-            SMTLOG("*** wrapper does not find [%s] in libc.so\n", cfree_symbol);
-            r = 1;
-            break;
-        }
+        if (!libc_cfree)
+            libc_cfree = libc_free;
 
         if (sem_init(&smtinit_sem, 0, 0)) {
             SMTLOG("*** semaphore init failed\n");
@@ -317,15 +876,17 @@ static void malloc_hook()
         SMTLOG("new AddressMap failed\n");
         exit(1);
     }
-    SMTMap* globalmap = new SMTMap("before main()", "main()", 0);
+    SMTMap* globalmap = new SMTMap("before main()", "main()", 0, 0);
     if (globalmap) {
         globalmap->stopAt("after main()", "main()", 0);
         smtmaplist->push_back(globalmap);
     }
+    __atomic_store_n(&smttable, new SMTTable(), __ATOMIC_RELEASE);
     use_origin_malloc = 0;
 }
 
-static char* getlogpath(SMTMap* mmap)
+// <program>.<pid>.<suffix>
+static char* getlogpath(const char* suffix)
 {
     static char logpath[PATH_MAX] = {0, };
     memset(logpath, 0x0, sizeof(logpath));
@@ -338,7 +899,7 @@ static char* getlogpath(SMTMap* mmap)
         if (fp) {
             if (fgets(buf, sizeof(buf)-1, fp))
                 sscanf(buf, "%*s %s", pp);
-            sprintf(logpath, "%s.%d.memoryleak.%p", pp, pid, mmap);
+            snprintf(logpath, sizeof(logpath), "%s.%d.%s", pp, pid, suffix);
             fclose(fp);
         }
     return logpath;
@@ -363,89 +924,360 @@ void copymaps(char* filepath)
     }
     SMTLOG("Copy %s to %s\n", mapfile, newmapfile);
     SMTLOG("Please use below command and try to find the memory leak line in your source file\n");
-    SMTLOG("smtaddr2line.sh %s %s %s\n", filepath, newmapfile, "/ #one specific directory that contains current current process's excutable binary and linked shared libraies");
+    SMTLOG("smtsymbolize %s %s [%s]\n", filepath, newmapfile, "a directory holding the executable and its shared libraries, when symbolizing on another machine");
 }
 
-static void detectmemoryleak(SMTMap* smtmap)
+// all leaked blocks allocated from one stack
+class SMTLeak {
+public:
+    uint32_t stackid;
+    void* p; // one of the blocks
+    size_t count;
+    size_t bytes;
+    size_t minsz;
+    size_t maxsz;
+    // sampled counts and bytes scaled back, equal to count and bytes
+    // when every allocation is tracked
+    double ecount;
+    double ebytes;
+};
+
+// biggest estimated leak first, stack id keeps the order stable
+static bool smtleakgreater(const SMTLeak& a, const SMTLeak& b)
 {
-    static std::map<void*, std::string> smap;
-    std::map<std::string, void*> btmap;
-    size_t lc = 0;
-    size_t i = 0;
-    size_t si = 0;
+    if (a.ebytes != b.ebytes)
+        return a.ebytes > b.ebytes;
+    return a.stackid < b.stackid;
+}
+
+// what the report prints for one pc
+class SMTFrame {
+public:
+    std::string object;
+    std::string function;
+    // "file:line" from .debug_line, empty when unknown
+    std::string line;
+};
+
+#if USE_WTF_SYMBOLIZE
+// one per report worker and kept across reports, they only reread
+// /proc/self/maps after dlopen() or dlclose()
+static WTF::SymbolizeSession* smtsymbolizers[SMTREPORTWORKERS];
+#endif
+
+// unique pcs of a report, symbolized by whichever worker claims the
+// next index
+class SMTSymbolizeJob {
+public:
+    void* const* pcs;
+    SMTFrame* frames;
+    size_t count;
+    size_t next;
+};
+
+class SMTSymbolizeWorker {
+public:
+    SMTSymbolizeJob* job;
+    int index;
+    pthread_t thread;
+};
+
+static void smtsymbolizeframe(void* pc, SMTFrame* frame, int worker)
+{
+    Dl_info info;
+    const char* functionname = 0;
+    if (!dladdr(pc, &info)) {
+        info.dli_fname = 0;
+        info.dli_sname = 0;
+    }
+    frame->object = info.dli_fname ? info.dli_fname : "(null)";
+#if USE_WTF_SYMBOLIZE
     char buf[1024];
-    std::map<void*, std::string>::iterator sit;
-    std::map<void*, MallocNode>::iterator it;
+    int line;
+    if (!smtsymbolizers[worker])
+        smtsymbolizers[worker] = new WTF::SymbolizeSession();
+    // a return address, look up the call instruction before it
+    void* address = static_cast<char*>(pc) - 1;
+    // many pcs share a function, and reports share most functions
+    const char* demangled = info.dli_sname ? WTF::CxaDemangleCached(info.dli_sname) : 0;
+    functionname = demangled ? demangled : info.dli_sname;
+    if (!functionname && smtsymbolizers[worker]->Symbolize(address, buf, sizeof(buf)))
+        functionname = buf;
+    frame->function = functionname ? functionname : "(null)";
+    if (smtsymbolizers[worker]->SymbolizeLine(address, buf, sizeof(buf), &line)) {
+        char number[16];
+        snprintf(number, sizeof(number), ":%d", line);
+        frame->line = std::string(buf) + number;
+    }
+#else
+    // dladdr() needs no per worker state
+    (void)worker;
+    functionname = info.dli_sname;
+    frame->function = functionname ? functionname : "(null)";
+#endif
+}
+
+static void smtsymbolizework(SMTSymbolizeJob* job, int worker)
+{
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+        smtsymbolizeframe(job->pcs[i], &job->frames[i], worker);
+}
+
+static void* smtsymbolizeworker(void* arg)
+{
+    SMTSymbolizeWorker* worker = static_cast<SMTSymbolizeWorker*>(arg);
+    use_origin_malloc = 1;
+    smtsymbolizework(worker->job, worker->index);
+    return 0;
+}
+
+// SMT_REPORT_THREADS=<n> caps the workers, the default is one per cpu
+static int smtreportworkers(size_t count)
+{
+    const char* threads = getenv("SMT_REPORT_THREADS");
+    long n = threads ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+    // a thread is not worth starting for a few hundred pcs
+    if ((size_t)n > count / SMTREPORTBATCH + 1)
+        n = count / SMTREPORTBATCH + 1;
+    if (n > SMTREPORTWORKERS)
+        n = SMTREPORTWORKERS;
+    return n < 1 ? 1 : n;
+}
+
+// symbolize pcs[0..count) into frames, on as many threads as it pays for
+static void smtsymbolize(void* const* pcs, SMTFrame* frames, size_t count)
+{
+    SMTSymbolizeJob job;
+    SMTSymbolizeWorker workers[SMTREPORTWORKERS];
+    int n = smtreportworkers(count);
+    int started = 0;
+    job.pcs = pcs;
+    job.frames = frames;
+    job.count = count;
+    job.next = 0;
+    // this thread is worker 0
+    for (int w = 1; w < n; w++) {
+        workers[w].job = &job;
+        workers[w].index = w;
+        if (pthread_create(&workers[w].thread, 0, smtsymbolizeworker, &workers[w]))
+            break;
+        started = w;
+    }
+    smtsymbolizework(&job, 0);
+    for (int w = 1; w <= started; w++)
+        pthread_join(workers[w].thread, 0);
+}
+
+// frames symbolized by earlier reports.  Never destroyed: the last
+// report runs from a destructor, after static objects are gone.
+static std::map<void*, SMTFrame>* smtframes = 0;
+
+// blocks of one report grouped by stack, with the totals over all of them
+class SMTLeakSet {
+public:
+    SMTLeakSet()
+        : count(0)
+        , bytes(0)
+        , ecount(0)
+        , ebytes(0)
+    {
+    }
+    std::vector<SMTLeak> leaks;
+    size_t count;
+    size_t bytes;
+    double ecount;
+    double ebytes;
+};
+
+// a live block smtcollect() copied out of a shard
+class SMTCollected {
+public:
+    void* p;
+    size_t sz;
+    uint32_t stackid;
+};
+
+// Group the live blocks allocated at or after epoch and before until by
+// stack, biggest first.  A shard lock is only held to copy its blocks
+// into a buffer big enough for all of them: nothing is allocated under
+// it, threads allocating into that shard only wait for the copy.  The
+// depot interns stacks, so the id alone tells duplicates and indexes the
+// group directly.
+static void smtcollect(SMTTable* table, uint32_t epoch, uint32_t until, SMTLeakSet* set)
+{
+    std::vector<size_t> group;
+    std::vector<SMTCollected> blocks;
+    MMap::iterator it;
+    for (size_t k = 0; k < SMTSHARDS; k++) {
+        SMTShard& shard = table->shards[k];
+        blocks.clear();
+        shard.lock.lock();
+        // grown unlocked until the shard fits, it may grow meanwhile
+        while (shard.mmap.size() > blocks.capacity()) {
+            size_t n = shard.mmap.size();
+            shard.lock.unlock();
+            blocks.reserve(n + n / 8 + 16);
+            shard.lock.lock();
+        }
+        for (it = shard.mmap.begin(); it != shard.mmap.end(); ++it) {
+            if (it.value().epoch < epoch || it.value().epoch >= until)
+                continue;
+            SMTCollected block;
+            block.p = it.key();
+            block.sz = it.value().sz;
+            block.stackid = it.value().stackid;
+            blocks.push_back(block);
+        }
+        shard.lock.unlock();
+        for (size_t i = 0; i < blocks.size(); i++) {
+            size_t sz = blocks[i].sz;
+            uint32_t stackid = blocks[i].stackid;
+            double weight = smtsampleweight(sz);
+            set->count++;
+            set->bytes += sz;
+            set->ecount += weight;
+            set->ebytes += sz * weight;
+            if (stackid >= group.size())
+                group.resize(smtdepot.size() + 1, (size_t)-1);
+            if (group[stackid] == (size_t)-1) {
+                SMTLeak leak;
+                leak.stackid = stackid;
+                leak.p = blocks[i].p;
+                leak.count = 0;
+                leak.bytes = 0;
+                leak.minsz = sz;
+                leak.maxsz = sz;
+                leak.ecount = 0;
+                leak.ebytes = 0;
+                group[stackid] = set->leaks.size();
+                set->leaks.push_back(leak);
+            }
+            SMTLeak& leak = set->leaks[group[stackid]];
+            leak.count++;
+            leak.bytes += sz;
+            leak.minsz = std::min(leak.minsz, sz);
+            leak.maxsz = std::max(leak.maxsz, sz);
+            leak.ecount += weight;
+            leak.ebytes += sz * weight;
+        }
+    }
+    std::sort(set->leaks.begin(), set->leaks.end(), smtleakgreater);
+}
+
+// Symbolize every pc of the stacks once, skipping those earlier reports
+// resolved.  Caller holds reportlock.
+static void smtresolve(const std::vector<uint32_t>& stackids)
+{
+    std::vector<void*> pcs;
+    std::vector<void*> unknown;
+    std::vector<SMTFrame> frames;
+    size_t i;
+    if (!smtframes)
+        smtframes = new std::map<void*, SMTFrame>();
+    for (i = 0; i < stackids.size(); i++) {
+        size_t depth = 0;
+        void* const* bt = smtdepot.get(stackids[i], &depth);
+        pcs.insert(pcs.end(), bt, bt + depth);
+    }
+    std::sort(pcs.begin(), pcs.end());
+    pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+    for (i = 0; i < pcs.size(); i++) {
+        if (smtframes->find(pcs[i]) == smtframes->end())
+            unknown.push_back(pcs[i]);
+    }
+    frames.resize(unknown.size());
+    if (!unknown.empty())
+        smtsymbolize(&unknown[0], &frames[0], unknown.size());
+    for (i = 0; i < unknown.size(); i++)
+        (*smtframes)[unknown[i]] = frames[i];
+}
+
+// the frames of a stack resolved by smtresolve()
+static void smtwriteframes(FILE* f, uint32_t stackid)
+{
+    size_t depth = 0;
+    void* const* bt = smtdepot.get(stackid, &depth);
+    std::map<void*, SMTFrame>::iterator sit;
+    for (int j = 0; j < (int)depth; j++) {
+        sit = smtframes->find(bt[j]);
+        const SMTFrame& frame = sit->second;
+        if (frame.line.empty())
+            fprintf(f, "#%d\t%p\t%s\t%s\n", j+1, bt[j], frame.object.c_str(), frame.function.c_str());
+        else
+            fprintf(f, "#%d\t%p\t%s\t%s\t%s\n", j+1, bt[j], frame.object.c_str(), frame.function.c_str(), frame.line.c_str());
+    }
+}
+
+// one entry per stack of the set headed by label.  Caller holds reportlock.
+static void smtwritestacks(FILE* f, const char* label, const SMTLeakSet& set)
+{
+    std::vector<uint32_t> stackids;
+    size_t i;
+    for (i = 0; i < set.leaks.size(); i++)
+        stackids.push_back(set.leaks[i].stackid);
+    smtresolve(stackids);
+    for (i = 0; i < set.leaks.size(); i++) {
+        const SMTLeak& leak = set.leaks[i];
+        if (smtsampleinterval)
+            fprintf(f, "%s[%ld][%ld blocks, %ld bytes, %ld-%ld bytes each, one at %p] sampled, estimated %.0f blocks, %.0f bytes with BT:\n",
+                label, i+1, leak.count, leak.bytes, leak.minsz, leak.maxsz, leak.p, leak.ecount, leak.ebytes);
+        else
+            fprintf(f, "%s[%ld][%ld blocks, %ld bytes, %ld-%ld bytes each, one at %p] with BT:\n",
+                label, i+1, leak.count, leak.bytes, leak.minsz, leak.maxsz, leak.p);
+        smtwriteframes(f, leak.stackid);
+    }
+}
+
+static void detectmemoryleak(SMTTable* table, SMTMap* smtmap)
+{
+    SMTLeakSet set;
+    SMTLeakSet inherited;
+    size_t lc = 0;
     FILE* f = 0;
     struct timespec before, after;
     char* filepath = 0;
-    MMap* mmap = 0;
-    if (!smtmap)
+    size_t count = 0;
+    if (!table || !smtmap)
         return;
-    mmap = &(smtmap->mmap);
-    SMTLOG("Found [%ld] Memory Leak \n", mmap->size());
+    pthread_mutex_lock(&reportlock);
+    count = table->count(smtmap->startepoch);
+    SMTLOG("Found [%ld] Memory Leak \n", count);
     SMTLOG("From [%s %s %ld]\n", smtmap->startfile, smtmap->startfunction, smtmap->startline);
     SMTLOG("To [%s %s %ld]\n", smtmap->stopfile, smtmap->stopfunction, smtmap->stopline);
     clock_gettime(CLOCK_REALTIME, &before);
-    if (!mmap->empty()) {
-        filepath = getlogpath(smtmap);
+    if (count) {
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), "memoryleak.%p", smtmap);
+        filepath = getlogpath(suffix);
         f = fopen(filepath, "w");
         if (!f) {
             SMTLOG("*** Fail to open log file %s to write\n", filepath);
+            pthread_mutex_unlock(&reportlock);
             return;
         }
     }
-    for (it = mmap->begin(); it != mmap->end(); ++it) {
-        void* p = it->first;
-        size_t sz = it->second.sz;
-        void** bt = it->second.bt;
-        int j;
-        lc += sz;
-        std::string btstr;
-        for (j = 0; j < BTSZ; j++) {
-            if (!bt[j])
-                break;
-            char buffer[BTAL];
-            snprintf(buffer, sizeof(buffer), "%p", bt[j]);
-            btstr.append(buffer);
-        }
-        if (btmap.find(btstr) != btmap.end()) {
-            si++;
-            continue;
-        }
-        btmap.insert(std::pair<std::string, void*>(btstr, p));
-        i++;
-        fprintf(f, "MEMORYLEAK[%ld][%p, %ld] with BT:\n", i, p, sz);
-        for (j = 0; j < BTSZ; j++) {
-            Dl_info info;
-            const char* cxaDemangled = 0;
-            const char* objectpath = 0;
-            const char* functionname = 0;
-            if (!bt[j])
-                break;
-            dladdr(bt[j], &info);
-            objectpath = info.dli_fname ? info.dli_fname : 0;
-#if USE_WTF_SYMBOLIZE
-            cxaDemangled = info.dli_sname ? abi::__cxa_demangle(info.dli_sname, 0, 0, 0) : 0;
-            functionname = cxaDemangled ? cxaDemangled : info.dli_sname ? info.dli_sname : 0;
-            if (!functionname)
-                if (sit = smap.find(bt[j]), sit != smap.end())
-                    functionname = sit->second.c_str();
-            if (!functionname) {
-                void* address = static_cast<char*>(bt[j]) - 1;
-                if (WTF::Symbolize(address, buf, sizeof(buf))) {
-                    functionname = buf;
-                    smap.insert(std::pair<void*, std::string>(bt[j], std::string(functionname)));
-                }
-            }
-#else
-            functionname = info.dli_sname ? info.dli_sname : 0;
-#endif
-            fprintf(f, "#%d\t%p\t%s\t%s\n", j+1, bt[j], objectpath ? objectpath : "(null)", functionname ? functionname : "(null)");
-        }
+    // in a forked child, blocks allocated before the fork are listed
+    // apart as INHERITED, they are the parent's and not this process's
+    uint32_t own = std::max(smtmap->startepoch, smtforkepoch);
+    smtcollect(table, own, UINT32_MAX, &set);
+    if (own > smtmap->startepoch)
+        smtcollect(table, smtmap->startepoch, own, &inherited);
+    lc = set.bytes;
+    if (f) {
+        smtwritestacks(f, "MEMORYLEAK", set);
+        smtwritestacks(f, "INHERITED", inherited);
     }
+    if (inherited.count)
+        SMTLOG("[%ld] blocks, [%ld] bytes allocated before fork() in parent [%d] are still live, see INHERITED in [%s]\n",
+            inherited.count, inherited.bytes, smtparentpid, filepath);
     clock_gettime(CLOCK_REALTIME, &after);
-    SMTLOG("Use %lus and %luns to find memory leak, %ld same memory leak\n", after.tv_sec - before.tv_sec, after.tv_nsec - before.tv_nsec, si);
+    SMTLOG("Use %lus and %luns to find memory leak, from %ld different stacks\n", after.tv_sec - before.tv_sec, after.tv_nsec - before.tv_nsec, set.leaks.size());
+    if (smtsampleinterval && count) {
+        SMTLOG("Sampled one allocation per ~%ld bytes: [%ld] leaks and [%ld] bytes sampled\n", smtsampleinterval, count, lc);
+        SMTLOG("Estimated [%.0f] Memory Leak\n", set.ecount);
+        lc = (size_t)(set.ebytes + 0.5);
+    }
     if (lc) {
         SMTLOG(COLOR_RED"!!!!!!ERROR ERROR ERROR!!!!!!\n");
         SMTLOG(COLOR_RED"!!!!!!ERROR ERROR ERROR!!!!!!\n");
@@ -462,69 +1294,1524 @@ static void detectmemoryleak(SMTMap* smtmap)
 #endif
         fclose(f);
     }
+    if (smtsizes) {
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), "memoryleak.%p.sizes", smtmap);
+        smtreportsizes(getlogpath(suffix));
+    }
+    if (smtlifetimes) {
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), "memoryleak.%p.lifetimes", smtmap);
+        smtreportlifetimes(getlogpath(suffix));
+    }
+    pthread_mutex_unlock(&reportlock);
 }
 
-void tr_where(char c, void* p, size_t sz)
+// Write every live block grouped by stack to <program>.<pid>.heap.<n>,
+// while the other threads keep running.  Only the dumper thread calls it.
+static void smtdumpheap()
 {
-    void* bt[BTSZ];
-    std::vector<SMTMap*>::iterator it;
-    SMTMap* smtmap = 0;
-    if (!smtmaplist || smtmaplist->empty())
+    static unsigned dumps = 0;
+    SMTTable* table = __atomic_load_n(&smttable, __ATOMIC_ACQUIRE);
+    SMTLeakSet set;
+    struct timespec before, after;
+    char suffix[64];
+    if (!table)
+        return;
+    // publish what other threads still hold in their caches and rings
+    smtlocalflush();
+    smtflush();
+    pthread_mutex_lock(&reportlock);
+    clock_gettime(CLOCK_REALTIME, &before);
+    snprintf(suffix, sizeof(suffix), "heap.%u", ++dumps);
+    char* filepath = getlogpath(suffix);
+    FILE* f = fopen(filepath, "w");
+    if (!f) {
+        SMTLOG("*** Fail to open heap profile %s to write\n", filepath);
+        pthread_mutex_unlock(&reportlock);
         return;
-    use_origin_malloc = 1;
-    if (c == '+') {
-        size_t btsz = backtrace(bt, BTSZ);
-        pthread_mutex_lock(&maplock);
-        for (it = smtmaplist->begin(); it != smtmaplist->end(); ++it) {
-            smtmap = *it;
-            if (smtmap)
-                smtmap->insert(p, sz, bt+2, btsz - 2);
-        }
-        pthread_mutex_unlock(&maplock);
-    } else {
-        pthread_mutex_lock(&maplock);
-        for (it = smtmaplist->begin(); it != smtmaplist->end(); ++it) {
-            smtmap = *it;
-            if (smtmap)
-                smtmap->erase(p);
-        }
-        pthread_mutex_unlock(&maplock);
     }
-    use_origin_malloc = 0;
+    smtcollect(table, 0, UINT32_MAX, &set);
+    if (smtsampleinterval)
+        fprintf(f, "HEAP [%ld] blocks, [%ld] bytes sampled, estimated [%.0f] blocks, [%.0f] bytes live\n", set.count, set.bytes, set.ecount, set.ebytes);
+    else
+        fprintf(f, "HEAP [%ld] blocks, [%ld] bytes live\n", set.count, set.bytes);
+    smtwritestacks(f, "LIVE", set);
+    clock_gettime(CLOCK_REALTIME, &after);
+    SMTLOG("Dumped [%ld] live blocks, [%ld] bytes from %ld stacks to [%s] in %lus and %luns\n", set.count, set.bytes, set.leaks.size(), filepath, after.tv_sec - before.tv_sec, after.tv_nsec - before.tv_nsec);
+#if !USE_WTF_SYMBOLIZE
+    copymaps(filepath);
+#endif
+    fclose(f);
+    pthread_mutex_unlock(&reportlock);
 }
 
-void* malloc(size_t sz)
+// cumulative allocations, bytes and frees of one stack by one thread
+class SMTRate {
+public:
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t frees;
+};
+
+// One thread's SMTRates indexed by stack id, in pages mapped on first use
+// like the depot's.  Only the owning thread writes its counters and
+// readers sum every thread's, so the hooks never share a counter's cache
+// line.  Tables of exited threads keep their counts and are handed to
+// new threads.
+class SMTRateTable {
+public:
+    SMTRate* pages[SDPAGES];
+    int dead;
+    SMTRateTable* next;
+};
+
+static SMTRateTable* smtratetables = 0;
+static __thread SMTRateTable* smtratetable = 0;
+static pthread_key_t smtratekey;
+static pthread_mutex_t ratelock = PTHREAD_MUTEX_INITIALIZER;
+// totals and time of the previous rate report, rates are over the
+// interval since then
+static std::vector<SMTRate>* smtratelast = 0;
+static struct timespec smtratetime;
+
+static void smtrateexit(void* arg)
 {
-    void* r = 0;
-    if (!libc_malloc) {
-        SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
-        malloc_hook();
-    }
-    r = libc_malloc(sz);
-    if (!use_origin_malloc && r) {
-        tr_where('+', r, sz);
+    pthread_mutex_lock(&ratelock);
+    static_cast<SMTRateTable*>(arg)->dead = 1;
+    pthread_mutex_unlock(&ratelock);
+    smtratetable = 0;
+}
+
+static void smtstartrates()
+{
+    if (pthread_key_create(&smtratekey, smtrateexit)) {
+        SMTLOG("*** fail to init allocation rate counters\n");
+        return;
     }
-    return r;
+    clock_gettime(CLOCK_MONOTONIC, &smtratetime);
+    smtrates = 1;
 }
 
-void* realloc(void* p, size_t sz)
+static SMTRateTable* smtregisterrates()
 {
-    void* r = 0;
-    if (!libc_realloc) {
-        SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
-        malloc_hook();
+    SMTRateTable* table;
+    pthread_mutex_lock(&ratelock);
+    for (table = smtratetables; table; table = table->next) {
+        if (table->dead) {
+            table->dead = 0;
+            break;
+        }
     }
-    r = libc_realloc(p, sz);
-    if (!use_origin_malloc && r && r != p) {
-        tr_where('+', r, sz);
+    if (!table) {
+        void* mem = mmap(0, sizeof(SMTRateTable), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            table = static_cast<SMTRateTable*>(mem);
+            table->next = smtratetables;
+            __atomic_store_n(&smtratetables, table, __ATOMIC_RELEASE);
+        }
     }
-    return r;
+    pthread_mutex_unlock(&ratelock);
+    if (table) {
+        smtratetable = table;
+        pthread_setspecific(smtratekey, table);
+    }
+    return table;
 }
 
-static void* static_calloc(size_t size)
+// this thread's counters of a stack, 0 when they cannot be mapped
+static SMTRate* smtrate(uint32_t stackid)
 {
-    static char memory_pool[1024] = {0, };
-    static size_t pool_index = 0;
+    SMTRateTable* table = smtratetable ? smtratetable : smtregisterrates();
+    size_t page = stackid >> SDPAGESHIFT;
+    if (!table || page >= SDPAGES)
+        return 0;
+    SMTRate* rates = table->pages[page];
+    if (!rates) {
+        void* mem = mmap(0, sizeof(SMTRate) << SDPAGESHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return 0;
+        rates = static_cast<SMTRate*>(mem);
+        __atomic_store_n(&table->pages[page], rates, __ATOMIC_RELEASE);
+    }
+    return &rates[stackid & ((1 << SDPAGESHIFT) - 1)];
+}
+
+// single writer, the stores only need to be whole for readers
+static void smtcountalloc(uint32_t stackid, size_t sz)
+{
+    SMTRate* rate = smtrate(stackid);
+    if (rate) {
+        __atomic_store_n(&rate->allocs, rate->allocs + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&rate->bytes, rate->bytes + sz, __ATOMIC_RELAXED);
+    }
+}
+
+static void smtcountfree(uint32_t stackid)
+{
+    SMTRate* rate = smtrate(stackid);
+    if (rate)
+        __atomic_store_n(&rate->frees, rate->frees + 1, __ATOMIC_RELAXED);
+}
+
+// the child counts its own allocations from zero
+static void smtratesafterfork()
+{
+    if (!smtrates)
+        return;
+    pthread_mutex_init(&ratelock, 0);
+    for (SMTRateTable* table = smtratetables; table; table = table->next) {
+        for (size_t i = 0; i < SDPAGES; i++) {
+            if (table->pages[i])
+                memset(table->pages[i], 0, sizeof(SMTRate) << SDPAGESHIFT);
+        }
+        if (table != smtratetable)
+            table->dead = 1;
+    }
+    if (smtratelast)
+        smtratelast->clear();
+    clock_gettime(CLOCK_MONOTONIC, &smtratetime);
+}
+
+// a stack's counts since the previous rate report
+class SMTHotSpot {
+public:
+    uint32_t stackid;
+    SMTRate total;
+    SMTRate delta;
+};
+
+static bool smthotspotgreater(const SMTHotSpot& a, const SMTHotSpot& b)
+{
+    if (a.delta.allocs != b.delta.allocs)
+        return a.delta.allocs > b.delta.allocs;
+    if (a.delta.bytes != b.delta.bytes)
+        return a.delta.bytes > b.delta.bytes;
+    return a.stackid < b.stackid;
+}
+
+// Sum every thread's counters and write the SMTRATETOP stacks that
+// allocated most often since the previous report to
+// <program>.<pid>.rates.<n>.
+static void smtreportrates()
+{
+    static unsigned reports = 0;
+    std::vector<SMTRate> totals;
+    std::vector<SMTHotSpot> hot;
+    std::vector<uint32_t> stackids;
+    SMTRate sum = { 0, 0, 0 };
+    struct timespec now;
+    char suffix[64];
+    size_t i;
+    if (!smtrates)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    totals.resize(smtdepot.size() + 1);
+    memset(&totals[0], 0, totals.size() * sizeof(SMTRate));
+    for (SMTRateTable* table = __atomic_load_n(&smtratetables, __ATOMIC_ACQUIRE); table; table = table->next) {
+        for (size_t page = 0; page < SDPAGES && (page << SDPAGESHIFT) < totals.size(); page++) {
+            SMTRate* rates = __atomic_load_n(&table->pages[page], __ATOMIC_ACQUIRE);
+            if (!rates)
+                continue;
+            for (i = 0; i < ((size_t)1 << SDPAGESHIFT) && (page << SDPAGESHIFT) + i < totals.size(); i++) {
+                SMTRate& total = totals[(page << SDPAGESHIFT) + i];
+                total.allocs += __atomic_load_n(&rates[i].allocs, __ATOMIC_RELAXED);
+                total.bytes += __atomic_load_n(&rates[i].bytes, __ATOMIC_RELAXED);
+                total.frees += __atomic_load_n(&rates[i].frees, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (!smtratelast)
+        smtratelast = new std::vector<SMTRate>();
+    for (i = 1; i < totals.size(); i++) {
+        SMTHotSpot spot;
+        SMTRate last = { 0, 0, 0 };
+        if (i < smtratelast->size())
+            last = (*smtratelast)[i];
+        spot.stackid = i;
+        spot.total = totals[i];
+        spot.delta.allocs = totals[i].allocs - last.allocs;
+        spot.delta.bytes = totals[i].bytes - last.bytes;
+        spot.delta.frees = totals[i].frees - last.frees;
+        sum.allocs += spot.delta.allocs;
+        sum.bytes += spot.delta.bytes;
+        sum.frees += spot.delta.frees;
+        if (spot.delta.allocs || spot.delta.frees)
+            hot.push_back(spot);
+    }
+    double seconds = (now.tv_sec - smtratetime.tv_sec) + (now.tv_nsec - smtratetime.tv_nsec) * 1e-9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    smtratelast->swap(totals);
+    smtratetime = now;
+    std::sort(hot.begin(), hot.end(), smthotspotgreater);
+    if (hot.size() > SMTRATETOP)
+        hot.resize(SMTRATETOP);
+
+    pthread_mutex_lock(&reportlock);
+    snprintf(suffix, sizeof(suffix), "rates.%u", ++reports);
+    char* filepath = getlogpath(suffix);
+    FILE* f = fopen(filepath, "w");
+    if (!f) {
+        SMTLOG("*** Fail to open allocation rates %s to write\n", filepath);
+        pthread_mutex_unlock(&reportlock);
+        return;
+    }
+    fprintf(f, "RATES [%lu] allocations, [%lu] bytes, [%lu] frees%s over %.3fs: %.0f allocs/s, %.0f bytes/s, %.0f frees/s\n",
+        sum.allocs, sum.bytes, sum.frees, smtsampleinterval ? " sampled" : "", seconds,
+        sum.allocs / seconds, sum.bytes / seconds, sum.frees / seconds);
+    for (i = 0; i < hot.size(); i++)
+        stackids.push_back(hot[i].stackid);
+    smtresolve(stackids);
+    for (i = 0; i < hot.size(); i++) {
+        const SMTHotSpot& spot = hot[i];
+        fprintf(f, "HOT[%ld][%.0f allocs/s, %.0f bytes/s, %.0f frees/s, %lu allocs, %lu bytes, %lu frees in all] with BT:\n",
+            i+1, spot.delta.allocs / seconds, spot.delta.bytes / seconds, spot.delta.frees / seconds,
+            spot.total.allocs, spot.total.bytes, spot.total.frees);
+        smtwriteframes(f, spot.stackid);
+    }
+    SMTLOG("%.0f allocs/s, %.0f bytes/s over %.3fs, top callsites in [%s]\n", sum.allocs / seconds, sum.bytes / seconds, seconds, filepath);
+#if !USE_WTF_SYMBOLIZE
+    copymaps(filepath);
+#endif
+    fclose(f);
+    pthread_mutex_unlock(&reportlock);
+}
+
+static const char* smthooknames[SMTHOOKS] = {
+    "malloc", "calloc", "realloc", "posix_memalign", "aligned_alloc", "memalign", "new", "new[]"
+};
+
+// counts per log2 size class: class 0 is size 0, class k holds sizes
+// 2^(k-1) to 2^k - 1
+class SMTSizeHistogram {
+public:
+    uint64_t counts[SMTSIZECLASSES];
+};
+
+// counts per decade of lifetime: class k < SMTLIFETIMECLASSES - 1 holds
+// blocks freed within 10^(k+1) ns, the last class everything longer
+class SMTLifetimeHistogram {
+public:
+    uint64_t counts[SMTLIFETIMECLASSES];
+};
+
+// One thread's histograms: sizes per hook for every allocation, sizes
+// per stack for tracked ones and lifetimes per stack for tracked blocks
+// this thread freed, the latter two in pages of 1 << SMTSIZEPAGESHIFT
+// stacks mapped on first use.  Only the owning thread writes them, with
+// plain stores and no atomic read-modify-write; reports sum every
+// thread's.  Tables of exited threads keep their counts and are handed
+// to new threads.
+class SMTHistogramTable {
+public:
+    SMTSizeHistogram hooks[SMTHOOKS];
+    SMTSizeHistogram* sizes[SMTSIZEPAGES];
+    SMTLifetimeHistogram* lifetimes[SMTSIZEPAGES];
+    int dead;
+    SMTHistogramTable* next;
+};
+
+static SMTHistogramTable* smthistogramtables = 0;
+static __thread SMTHistogramTable* smthistogramtable = 0;
+static pthread_key_t smthistogramkey;
+static pthread_mutex_t histogramlock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int smtsizeclass(size_t sz)
+{
+    return sz ? 64 - __builtin_clzll(sz) : 0;
+}
+
+static void smthistogramexit(void* arg)
+{
+    pthread_mutex_lock(&histogramlock);
+    static_cast<SMTHistogramTable*>(arg)->dead = 1;
+    pthread_mutex_unlock(&histogramlock);
+    smthistogramtable = 0;
+}
+
+static int smtstarthistograms()
+{
+    static int started = 0;
+    if (!started && !pthread_key_create(&smthistogramkey, smthistogramexit))
+        started = 1;
+    return started;
+}
+
+static void smtstartsizes()
+{
+    if (!smtstarthistograms()) {
+        SMTLOG("*** fail to init size histograms\n");
+        return;
+    }
+    smtsizes = 1;
+}
+
+// called from the hooks, so it must not allocate through them
+static SMTHistogramTable* smtregisterhistograms()
+{
+    SMTHistogramTable* table;
+    int origin = use_origin_malloc;
+    use_origin_malloc = 1;
+    pthread_mutex_lock(&histogramlock);
+    for (table = smthistogramtables; table; table = table->next) {
+        if (table->dead) {
+            table->dead = 0;
+            break;
+        }
+    }
+    if (!table) {
+        void* mem = mmap(0, sizeof(SMTHistogramTable), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            table = static_cast<SMTHistogramTable*>(mem);
+            table->next = smthistogramtables;
+            __atomic_store_n(&smthistogramtables, table, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&histogramlock);
+    if (table) {
+        smthistogramtable = table;
+        pthread_setspecific(smthistogramkey, table);
+    }
+    use_origin_malloc = origin;
+    return table;
+}
+
+static void smtcountsize(int hook, size_t sz)
+{
+    SMTHistogramTable* table = smthistogramtable ? smthistogramtable : smtregisterhistograms();
+    if (table) {
+        uint64_t* count = &table->hooks[hook].counts[smtsizeclass(sz)];
+        __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    }
+}
+
+// this thread's histogram of stackid in pages, mapping its page on
+// first use
+extern "C++" template<typename Histogram>
+inline Histogram* smthistogram(Histogram** pages, uint32_t stackid)
+{
+    size_t page = stackid >> SMTSIZEPAGESHIFT;
+    if (page >= SMTSIZEPAGES)
+        return 0;
+    Histogram* histograms = pages[page];
+    if (!histograms) {
+        void* mem = mmap(0, sizeof(Histogram) << SMTSIZEPAGESHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return 0;
+        histograms = static_cast<Histogram*>(mem);
+        __atomic_store_n(&pages[page], histograms, __ATOMIC_RELEASE);
+    }
+    return &histograms[stackid & ((1 << SMTSIZEPAGESHIFT) - 1)];
+}
+
+static void smtcountcallsite(uint32_t stackid, size_t sz)
+{
+    SMTHistogramTable* table = smthistogramtable ? smthistogramtable : smtregisterhistograms();
+    SMTSizeHistogram* histogram = table ? smthistogram(table->sizes, stackid) : 0;
+    if (histogram) {
+        uint64_t* count = &histogram->counts[smtsizeclass(sz)];
+        __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    }
+}
+
+// smtsample() for an allocation made through hook, counted in the size
+// histograms first when they are on
+static inline int smtsampleat(int hook, size_t sz)
+{
+    if (smtsizes)
+        smtcountsize(hook, sz);
+    return smtsample(sz);
+}
+
+// the child counts its own allocations from zero
+static void smthistogramsafterfork()
+{
+    if (!smtsizes && !smtlifetimes)
+        return;
+    pthread_mutex_init(&histogramlock, 0);
+    for (SMTHistogramTable* table = smthistogramtables; table; table = table->next) {
+        memset(table->hooks, 0, sizeof(table->hooks));
+        for (size_t i = 0; i < SMTSIZEPAGES; i++) {
+            if (table->sizes[i])
+                memset(table->sizes[i], 0, sizeof(SMTSizeHistogram) << SMTSIZEPAGESHIFT);
+            if (table->lifetimes[i])
+                memset(table->lifetimes[i], 0, sizeof(SMTLifetimeHistogram) << SMTSIZEPAGESHIFT);
+        }
+        if (table != smthistogramtable)
+            table->dead = 1;
+    }
+}
+
+static void smtaddhistogram(SMTSizeHistogram* sum, const SMTSizeHistogram& h)
+{
+    for (int k = 0; k < SMTSIZECLASSES; k++)
+        sum->counts[k] += __atomic_load_n(&h.counts[k], __ATOMIC_RELAXED);
+}
+
+// "<low>-<high> x<count>" for every non-empty class
+static void smtwritehistogram(FILE* f, const SMTSizeHistogram& h)
+{
+    const char* separator = "";
+    for (int k = 0; k < SMTSIZECLASSES; k++) {
+        if (!h.counts[k])
+            continue;
+        if (!k) {
+            fprintf(f, "%s0 x%lu", separator, h.counts[k]);
+        } else {
+            uint64_t low = (uint64_t)1 << (k - 1);
+            fprintf(f, "%s%lu-%lu x%lu", separator, low, low * 2 - 1, h.counts[k]);
+        }
+        separator = ", ";
+    }
+}
+
+static uint64_t smthistogramtotal(const SMTSizeHistogram& h)
+{
+    uint64_t total = 0;
+    for (int k = 0; k < SMTSIZECLASSES; k++)
+        total += h.counts[k];
+    return total;
+}
+
+class SMTCallsiteSizes {
+public:
+    uint32_t stackid;
+    uint64_t total;
+};
+
+static bool smtcallsitesizesgreater(const SMTCallsiteSizes& a, const SMTCallsiteSizes& b)
+{
+    if (a.total != b.total)
+        return a.total > b.total;
+    return a.stackid < b.stackid;
+}
+
+// Merge every thread's histograms into filepath: one per hook, then the
+// SMTSIZETOP stacks that allocated most.  Caller holds reportlock.
+static void smtreportsizes(const char* filepath)
+{
+    SMTSizeHistogram hooks[SMTHOOKS];
+    std::vector<SMTCallsiteSizes> callsites;
+    std::vector<uint32_t> stackids;
+    std::vector<uint64_t> totals;
+    SMTHistogramTable* tables = __atomic_load_n(&smthistogramtables, __ATOMIC_ACQUIRE);
+    SMTHistogramTable* table;
+    uint64_t all = 0;
+    size_t i;
+    int h;
+    memset(hooks, 0, sizeof(hooks));
+    totals.resize(smtdepot.size() + 1, 0);
+    for (table = tables; table; table = table->next) {
+        for (h = 0; h < SMTHOOKS; h++)
+            smtaddhistogram(&hooks[h], table->hooks[h]);
+        // count per stack first, only the top stacks get full histograms
+        for (size_t page = 0; page < SMTSIZEPAGES && (page << SMTSIZEPAGESHIFT) < totals.size(); page++) {
+            SMTSizeHistogram* histograms = __atomic_load_n(&table->sizes[page], __ATOMIC_ACQUIRE);
+            if (!histograms)
+                continue;
+            for (i = 0; i < ((size_t)1 << SMTSIZEPAGESHIFT) && (page << SMTSIZEPAGESHIFT) + i < totals.size(); i++) {
+                SMTSizeHistogram copy;
+                memset(&copy, 0, sizeof(copy));
+                smtaddhistogram(&copy, histograms[i]);
+                totals[(page << SMTSIZEPAGESHIFT) + i] += smthistogramtotal(copy);
+            }
+        }
+    }
+    for (h = 0; h < SMTHOOKS; h++)
+        all += smthistogramtotal(hooks[h]);
+    for (i = 1; i < totals.size(); i++) {
+        if (totals[i]) {
+            SMTCallsiteSizes callsite;
+            callsite.stackid = i;
+            callsite.total = totals[i];
+            callsites.push_back(callsite);
+        }
+    }
+    std::sort(callsites.begin(), callsites.end(), smtcallsitesizesgreater);
+    if (callsites.size() > SMTSIZETOP)
+        callsites.resize(SMTSIZETOP);
+
+    FILE* f = fopen(filepath, "w");
+    if (!f) {
+        SMTLOG("*** Fail to open size histograms %s to write\n", filepath);
+        return;
+    }
+    fprintf(f, "SIZES of [%lu] allocations since start, in log2 size classes, by hook and for the %ld callsites that allocated most%s\n",
+        all, callsites.size(), smtsampleinterval ? " (callsites sampled)" : "");
+    for (h = 0; h < SMTHOOKS; h++) {
+        uint64_t total = smthistogramtotal(hooks[h]);
+        fprintf(f, "HOOK[%s][%lu allocations]%s", smthooknames[h], total, total ? " " : "");
+        smtwritehistogram(f, hooks[h]);
+        fprintf(f, "\n");
+    }
+    for (i = 0; i < callsites.size(); i++)
+        stackids.push_back(callsites[i].stackid);
+    smtresolve(stackids);
+    for (i = 0; i < callsites.size(); i++) {
+        SMTSizeHistogram merged;
+        uint32_t id = callsites[i].stackid;
+        memset(&merged, 0, sizeof(merged));
+        for (table = tables; table; table = table->next) {
+            SMTSizeHistogram* histograms = __atomic_load_n(&table->sizes[id >> SMTSIZEPAGESHIFT], __ATOMIC_ACQUIRE);
+            if (histograms)
+                smtaddhistogram(&merged, histograms[id & ((1 << SMTSIZEPAGESHIFT) - 1)]);
+        }
+        fprintf(f, "CALLSITE[%ld][%lu allocations: ", i+1, smthistogramtotal(merged));
+        smtwritehistogram(f, merged);
+        fprintf(f, "] with BT:\n");
+        smtwriteframes(f, id);
+    }
+    fclose(f);
+    SMTLOG("Size histograms of [%lu] allocations in [%s]\n", all, filepath);
+}
+
+static const char* smtlifetimenames[SMTLIFETIMECLASSES] = {
+    "<10ns", "<100ns", "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s"
+};
+
+// upper bounds of the lifetime classes in smtclock() ticks, 10^(k+1) ns
+// for class k, set by smtstartlifetimes()
+static uint64_t smtlifetimebounds[SMTLIFETIMECLASSES - 1];
+
+static uint64_t smtnanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Timestamp of allocations and frees for SMT_LIFETIMES: the time stamp
+// counter where there is one, a few cycles instead of a clock_gettime()
+// per hook, monotonic nanoseconds elsewhere.
+static inline uint64_t smtclock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return smtnanoseconds();
+#endif
+}
+
+// calibrate smtclock() against CLOCK_MONOTONIC over a millisecond
+static void smtstartlifetimes()
+{
+    double ticksperns = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec pause = { 0, 1000000 };
+    uint64_t ns = smtnanoseconds();
+    uint64_t ticks = smtclock();
+    nanosleep(&pause, 0);
+    ns = smtnanoseconds() - ns;
+    ticks = smtclock() - ticks;
+    if (ns && ticks)
+        ticksperns = (double)ticks / ns;
+#endif
+    double bound = 10;
+    for (int k = 0; k < SMTLIFETIMECLASSES - 1; k++, bound *= 10)
+        smtlifetimebounds[k] = bound * ticksperns;
+    if (!smtstarthistograms()) {
+        SMTLOG("*** fail to init lifetime histograms\n");
+        return;
+    }
+    smtlifetimes = 1;
+}
+
+static void smtcountlifetime(uint32_t stackid, uint64_t allocated, uint64_t freed)
+{
+    // allocated before SMT_LIFETIMES was read
+    if (!allocated)
+        return;
+    SMTHistogramTable* table = smthistogramtable ? smthistogramtable : smtregisterhistograms();
+    SMTLifetimeHistogram* histogram = table ? smthistogram(table->lifetimes, stackid) : 0;
+    if (!histogram)
+        return;
+    // time stamp counters of different cpus may disagree by a little
+    uint64_t ticks = freed > allocated ? freed - allocated : 0;
+    int k = 0;
+    while (k < SMTLIFETIMECLASSES - 1 && ticks >= smtlifetimebounds[k])
+        k++;
+    uint64_t* count = &histogram->counts[k];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+class SMTCallsiteLifetimes {
+public:
+    uint32_t stackid;
+    // freed within 1us, within 1ms, later
+    uint64_t submicro;
+    uint64_t submilli;
+    uint64_t longer;
+};
+
+// most short-lived blocks first, the callsites worth a pool or stack
+// allocation
+static bool smtcallsitelifetimesgreater(const SMTCallsiteLifetimes& a, const SMTCallsiteLifetimes& b)
+{
+    if (a.submicro != b.submicro)
+        return a.submicro > b.submicro;
+    if (a.submilli != b.submilli)
+        return a.submilli > b.submilli;
+    if (a.longer != b.longer)
+        return a.longer > b.longer;
+    return a.stackid < b.stackid;
+}
+
+// Merge every thread's lifetime histograms into filepath, for the
+// SMTSIZETOP stacks with most blocks freed within a microsecond, then
+// within a millisecond.  Blocks still live are not counted, the leak
+// report has those.  Caller holds reportlock.
+static void smtreportlifetimes(const char* filepath)
+{
+    std::vector<SMTCallsiteLifetimes> callsites;
+    std::vector<uint32_t> stackids;
+    SMTHistogramTable* tables = __atomic_load_n(&smthistogramtables, __ATOMIC_ACQUIRE);
+    SMTHistogramTable* table;
+    uint64_t all = 0;
+    size_t i;
+    int k;
+    callsites.resize(smtdepot.size() + 1);
+    for (i = 0; i < callsites.size(); i++) {
+        memset(&callsites[i], 0, sizeof(callsites[i]));
+        callsites[i].stackid = i;
+    }
+    for (table = tables; table; table = table->next) {
+        for (size_t page = 0; page < SMTSIZEPAGES && (page << SMTSIZEPAGESHIFT) < callsites.size(); page++) {
+            SMTLifetimeHistogram* histograms = __atomic_load_n(&table->lifetimes[page], __ATOMIC_ACQUIRE);
+            if (!histograms)
+                continue;
+            for (i = 0; i < ((size_t)1 << SMTSIZEPAGESHIFT) && (page << SMTSIZEPAGESHIFT) + i < callsites.size(); i++) {
+                SMTCallsiteLifetimes& callsite = callsites[(page << SMTSIZEPAGESHIFT) + i];
+                for (k = 0; k < SMTLIFETIMECLASSES; k++) {
+                    uint64_t count = __atomic_load_n(&histograms[i].counts[k], __ATOMIC_RELAXED);
+                    if (k < 3)
+                        callsite.submicro += count;
+                    else if (k < 6)
+                        callsite.submilli += count;
+                    else
+                        callsite.longer += count;
+                    all += count;
+                }
+            }
+        }
+    }
+    std::sort(callsites.begin(), callsites.end(), smtcallsitelifetimesgreater);
+    for (i = 0; i < callsites.size() && i < SMTSIZETOP; i++) {
+        if (!callsites[i].submicro && !callsites[i].submilli && !callsites[i].longer)
+            break;
+    }
+    callsites.resize(i);
+
+    FILE* f = fopen(filepath, "w");
+    if (!f) {
+        SMTLOG("*** Fail to open lifetime histograms %s to write\n", filepath);
+        return;
+    }
+    fprintf(f, "LIFETIMES of [%lu] freed blocks since start, for the %ld callsites with most blocks freed within 1us, then 1ms%s\n",
+        all, callsites.size(), smtsampleinterval ? " (sampled)" : "");
+    for (i = 0; i < callsites.size(); i++)
+        stackids.push_back(callsites[i].stackid);
+    smtresolve(stackids);
+    for (i = 0; i < callsites.size(); i++) {
+        SMTLifetimeHistogram merged;
+        uint32_t id = callsites[i].stackid;
+        memset(&merged, 0, sizeof(merged));
+        for (table = tables; table; table = table->next) {
+            SMTLifetimeHistogram* histograms = __atomic_load_n(&table->lifetimes[id >> SMTSIZEPAGESHIFT], __ATOMIC_ACQUIRE);
+            if (!histograms)
+                continue;
+            for (k = 0; k < SMTLIFETIMECLASSES; k++)
+                merged.counts[k] += __atomic_load_n(&histograms[id & ((1 << SMTSIZEPAGESHIFT) - 1)].counts[k], __ATOMIC_RELAXED);
+        }
+        fprintf(f, "CALLSITE[%ld][%lu within 1us, %lu within 1ms, %lu longer:", i+1,
+            callsites[i].submicro, callsites[i].submilli, callsites[i].longer);
+        const char* separator = " ";
+        for (k = 0; k < SMTLIFETIMECLASSES; k++) {
+            if (!merged.counts[k])
+                continue;
+            fprintf(f, "%s%s x%lu", separator, smtlifetimenames[k], merged.counts[k]);
+            separator = ", ";
+        }
+        fprintf(f, "] with BT:\n");
+        smtwriteframes(f, id);
+    }
+    fclose(f);
+    SMTLOG("Lifetime histograms of [%lu] freed blocks in [%s]\n", all, filepath);
+}
+
+// how blocks of each SMTKIND* are allocated and how they must be freed
+static const char* smtallocnames[] = {
+    "malloc", "new", "new[]", "new(align)", "new[](align)"
+};
+static const char* smtfreenames[] = {
+    "free/realloc", "delete", "delete[]", "delete(align)", "delete[](align)"
+};
+
+// blocks of one stack freed the wrong way, and where the first of them
+// was freed, 0 when the free was applied asynchronously
+class SMTMismatch {
+public:
+    uint32_t stackid;
+    uint32_t freestackid;
+    int allocated;
+    int freed;
+    int wrongsize;
+    uint64_t count;
+};
+
+// mismatches are rare, a short table under a mutex is enough
+static SMTMismatch smtmismatches[SMTMISMATCHES];
+static size_t smtmismatchcount = 0;
+static uint64_t smtmismatchdropped = 0;
+static pthread_mutex_t mismatchlock = PTHREAD_MUTEX_INITIALIZER;
+
+// whether a block allocated as allocated, allocatedsz bytes, is freed
+// wrongly by a free of kind freed, by a sized delete when freedsz is not 0
+static int smtmismatched(int allocated, size_t allocatedsz, int freed, size_t freedsz)
+{
+    return allocated != freed || (freedsz && freedsz != allocatedsz);
+}
+
+static void smtmismatch(uint32_t stackid, int allocated, int freed, int wrongsize, uint32_t freestackid)
+{
+    size_t i;
+    pthread_mutex_lock(&mismatchlock);
+    for (i = 0; i < smtmismatchcount; i++) {
+        SMTMismatch& m = smtmismatches[i];
+        if (m.stackid == stackid && m.allocated == allocated && m.freed == freed && m.wrongsize == wrongsize) {
+            if (!m.freestackid)
+                m.freestackid = freestackid;
+            m.count++;
+            break;
+        }
+    }
+    if (i == smtmismatchcount) {
+        if (i < SMTMISMATCHES) {
+            SMTMismatch& m = smtmismatches[smtmismatchcount++];
+            m.stackid = stackid;
+            m.freestackid = freestackid;
+            m.allocated = allocated;
+            m.freed = freed;
+            m.wrongsize = wrongsize;
+            m.count = 1;
+            SMTLOG(COLOR_RED"*** block allocated by %s freed by %s%s, see the mismatch report at exit\n" COLOR_NONE,
+                smtallocnames[allocated], smtfreenames[freed], wrongsize ? " with the wrong size" : "");
+        } else {
+            smtmismatchdropped++;
+        }
+    }
+    pthread_mutex_unlock(&mismatchlock);
+}
+
+// the child reports its own mismatches
+static void smtmismatchesafterfork()
+{
+    pthread_mutex_init(&mismatchlock, 0);
+    smtmismatchcount = 0;
+    smtmismatchdropped = 0;
+}
+
+// Write every mismatch to <program>.<pid>.mismatch, with the stack of
+// the allocation and, when known, of the first wrong free.
+static void smtreportmismatches()
+{
+    std::vector<uint32_t> stackids;
+    size_t i;
+    pthread_mutex_lock(&mismatchlock);
+    std::vector<SMTMismatch> mismatches(smtmismatches, smtmismatches + smtmismatchcount);
+    uint64_t dropped = smtmismatchdropped;
+    pthread_mutex_unlock(&mismatchlock);
+    if (mismatches.empty())
+        return;
+    pthread_mutex_lock(&reportlock);
+    char* filepath = getlogpath("mismatch");
+    FILE* f = fopen(filepath, "w");
+    if (!f) {
+        SMTLOG("*** Fail to open mismatch report %s to write\n", filepath);
+        pthread_mutex_unlock(&reportlock);
+        return;
+    }
+    uint64_t total = dropped;
+    for (i = 0; i < mismatches.size(); i++) {
+        total += mismatches[i].count;
+        stackids.push_back(mismatches[i].stackid);
+        stackids.push_back(mismatches[i].freestackid);
+    }
+    fprintf(f, "MISMATCHES [%lu] blocks freed by a function that does not match their allocation", total);
+    if (dropped)
+        fprintf(f, ", [%lu] of them from stacks past the first %d", dropped, SMTMISMATCHES);
+    fprintf(f, "%s\n", smtsampleinterval ? " (sampled)" : "");
+    smtresolve(stackids);
+    for (i = 0; i < mismatches.size(); i++) {
+        const SMTMismatch& m = mismatches[i];
+        fprintf(f, "MISMATCH[%ld][%lu blocks allocated by %s, freed by %s%s] with BT:\n", i+1, m.count,
+            smtallocnames[m.allocated], smtfreenames[m.freed], m.wrongsize ? " with the wrong size" : "");
+        smtwriteframes(f, m.stackid);
+        if (m.freestackid) {
+            fprintf(f, "FREED with BT:\n");
+            smtwriteframes(f, m.freestackid);
+        }
+    }
+    SMTLOG(COLOR_RED"[%lu] blocks freed by the wrong function, see [%s]\n" COLOR_NONE, total, filepath);
+#if !USE_WTF_SYMBOLIZE
+    copymaps(filepath);
+#endif
+    fclose(f);
+    pthread_mutex_unlock(&reportlock);
+}
+
+// 1 when a free erased p, whose entry is then in *freed.  A '.' record
+// only fills the seq of a realloc() that failed.
+static int smtapply(char c, void* p, size_t sz, uint32_t stackid, uint32_t epoch, uint64_t time, int kind,
+    MallocNode* freed)
+{
+    SMTTable* table = __atomic_load_n(&smttable, __ATOMIC_ACQUIRE);
+    if (!table)
+        return 0;
+    if (c == '+') {
+        table->insert(p, sz, stackid, epoch, time, kind);
+        return 0;
+    }
+    if (c != '-')
+        return 0;
+    return table->erase(p, time, freed);
+}
+
+static SMTRing* smtregisterring()
+{
+    SMTRing* ring = 0;
+    pthread_mutex_lock(&ringlock);
+    for (ring = smtrings; ring; ring = ring->next) {
+        if (ring->dead && ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+            ring->dead = 0;
+            break;
+        }
+    }
+    if (!ring) {
+        void* mem = mmap(0, sizeof(SMTRing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            ring = new (mem) SMTRing();
+            ring->next = smtrings;
+            __atomic_store_n(&smtrings, ring, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&ringlock);
+    if (ring) {
+        smtring = ring;
+        pthread_setspecific(smtringkey, ring);
+    }
+    return ring;
+}
+
+// thread exit: apply what this thread left behind and recycle its ring
+static void smtringexit(void* arg)
+{
+    SMTRing* ring = static_cast<SMTRing*>(arg);
+    smtflush();
+    smtring = 0;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+// seq is one smtreserve() took, 0 to take the next
+static int smtpush(char c, void* p, size_t sz, uint32_t stackid, uint32_t epoch, uint64_t time, int kind,
+    const uint64_t* seq)
+{
+    SMTRing* ring = smtring ? smtring : smtregisterring();
+    if (!ring)
+        return 0;
+    size_t tail = ring->tail;
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= SMTRINGSZ) {
+        sem_post(&smtaggregatorsem);
+        sched_yield();
+    }
+    SMTRecord& r = ring->records[tail & (SMTRINGSZ - 1)];
+    r.p = p;
+    r.sz = sz;
+    r.stackid = stackid;
+    r.epoch = epoch;
+    r.time = time;
+    r.c = c;
+    r.kind = kind;
+    r.seq = seq ? *seq : __atomic_fetch_add(&smtseq, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// a seq for a record this thread pushes later, records are not applied
+// past it until then
+static int smtreserve(uint64_t* seq)
+{
+    if (!smtring && !smtregisterring())
+        return 0;
+    *seq = __atomic_fetch_add(&smtseq, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+static bool smtrecordless(const SMTRecord& a, const SMTRecord& b)
+{
+    return a.seq < b.seq;
+}
+
+// Move every published record into smtstaging, then apply them in seq
+// order up to the first hole left by a producer that has taken a seq
+// but not published yet.  With force, holes are skipped (only used
+// when their producers can no longer publish).  Caller holds drainlock.
+static void smtdrain(int force)
+{
+    SMTRing* ring;
+    for (ring = __atomic_load_n(&smtrings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        size_t head = ring->head;
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+            smtstaging->push_back(ring->records[head & (SMTRINGSZ - 1)]);
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    if (smtstaging->empty())
+        return;
+    std::sort(smtstaging->begin(), smtstaging->end(), smtrecordless);
+    std::vector<SMTRecord>::iterator it;
+    MallocNode freed;
+    for (it = smtstaging->begin(); it != smtstaging->end(); ++it) {
+        if (it->seq != smtapplied && !force)
+            break;
+        // the stack of the free is gone by now
+        if (smtapply(it->c, it->p, it->sz, it->stackid, it->epoch, it->time, it->kind, &freed)
+            && smtmismatched(freed.kind, freed.sz, it->kind, it->sz))
+            smtmismatch(freed.stackid, freed.kind, it->kind, freed.kind == it->kind, 0);
+        smtapplied = it->seq + 1;
+    }
+    smtstaging->erase(smtstaging->begin(), it);
+}
+
+// wait until every record stamped before this call has been applied
+static void smtflush()
+{
+    if (!__atomic_load_n(&smtasync, __ATOMIC_ACQUIRE))
+        return;
+    int origin = use_origin_malloc;
+    use_origin_malloc = 1;
+    uint64_t target = __atomic_load_n(&smtseq, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&drainlock);
+    while (smtapplied < target) {
+        smtdrain(0);
+        if (smtapplied < target)
+            sched_yield();
+    }
+    pthread_mutex_unlock(&drainlock);
+    use_origin_malloc = origin;
+}
+
+static void* smtaggregator(void*)
+{
+    use_origin_malloc = 1;
+    while (!__atomic_load_n(&smtaggregatorstop, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&drainlock);
+        smtdrain(0);
+        pthread_mutex_unlock(&drainlock);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += SMTDRAINUS * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&smtaggregatorsem, &ts);
+    }
+    return 0;
+}
+
+static void smtstartaggregator()
+{
+    int origin = use_origin_malloc;
+    use_origin_malloc = 1;
+    smtaggregatorstop = 0;
+    if (pthread_create(&smtaggregatorthread, 0, smtaggregator, 0)) {
+        SMTLOG("*** fail to create aggregator thread, apply events inline\n");
+        __atomic_store_n(&smtasync, 0, __ATOMIC_RELEASE);
+    } else {
+        smtaggregatorrunning = 1;
+    }
+    use_origin_malloc = origin;
+}
+
+static void smtstopaggregator()
+{
+    if (!smtaggregatorrunning)
+        return;
+    __atomic_store_n(&smtaggregatorstop, 1, __ATOMIC_RELEASE);
+    sem_post(&smtaggregatorsem);
+    pthread_join(smtaggregatorthread, 0);
+    smtaggregatorrunning = 0;
+}
+
+// live counters of every stack at one point in time, indexed by stack id
+class SMTSnapshot {
+public:
+    struct timespec time;
+    std::vector<intptr_t> counts;
+    std::vector<intptr_t> bytes;
+};
+
+// a stack whose live bytes grew at every snapshot
+class SMTGrowth {
+public:
+    uint32_t stackid;
+    intptr_t count;
+    intptr_t bytes;
+    intptr_t grewcount;
+    intptr_t grewbytes;
+};
+
+static bool smtgrowthgreater(const SMTGrowth& a, const SMTGrowth& b)
+{
+    if (a.grewbytes != b.grewbytes)
+        return a.grewbytes > b.grewbytes;
+    return a.stackid < b.stackid;
+}
+
+// ring of the last smtsnapshotdepth snapshots, only smtdumper() uses it
+static std::vector<SMTSnapshot>* smtsnapshots = 0;
+
+static intptr_t smtsnapshotbytes(const SMTSnapshot& snapshot, uint32_t id)
+{
+    return id < snapshot.bytes.size() ? snapshot.bytes[id] : 0;
+}
+
+// Rewrite <program>.<pid>.growth with the stacks whose live bytes grew
+// from each of the last smtsnapshotdepth snapshots to the next, also
+// when none did: the previous report must not outlive the growth.
+static void smtreportgrowth()
+{
+    std::vector<SMTGrowth> growth;
+    std::vector<uint32_t> stackids;
+    const SMTSnapshot& oldest = (*smtsnapshots)[smtsnapshottaken % smtsnapshotdepth];
+    const SMTSnapshot& newest = (*smtsnapshots)[(smtsnapshottaken - 1) % smtsnapshotdepth];
+    intptr_t total = 0;
+    size_t i;
+    for (uint32_t id = 1; id < newest.bytes.size(); id++) {
+        intptr_t last = smtsnapshotbytes(oldest, id);
+        for (i = 1; i < smtsnapshotdepth; i++) {
+            intptr_t bytes = smtsnapshotbytes((*smtsnapshots)[(smtsnapshottaken + i) % smtsnapshotdepth], id);
+            if (bytes <= last)
+                break;
+            last = bytes;
+        }
+        if (i < smtsnapshotdepth)
+            continue;
+        SMTGrowth g;
+        g.stackid = id;
+        g.count = newest.counts[id];
+        g.bytes = newest.bytes[id];
+        g.grewcount = g.count - (id < oldest.counts.size() ? oldest.counts[id] : 0);
+        g.grewbytes = g.bytes - smtsnapshotbytes(oldest, id);
+        total += g.grewbytes;
+        growth.push_back(g);
+    }
+    std::sort(growth.begin(), growth.end(), smtgrowthgreater);
+    double seconds = (newest.time.tv_sec - oldest.time.tv_sec) + (newest.time.tv_nsec - oldest.time.tv_nsec) * 1e-9;
+
+    pthread_mutex_lock(&reportlock);
+    char* filepath = getlogpath("growth");
+    FILE* f = fopen(filepath, "w");
+    if (!f) {
+        SMTLOG("*** Fail to open growth report %s to write\n", filepath);
+        pthread_mutex_unlock(&reportlock);
+        return;
+    }
+    fprintf(f, "GROWTH [%ld] stacks grew by [%ld] bytes over the last %ld snapshots, %.0fs%s\n",
+        growth.size(), total, smtsnapshotdepth, seconds, smtsampleinterval ? ", sampled" : "");
+    for (i = 0; i < growth.size(); i++)
+        stackids.push_back(growth[i].stackid);
+    smtresolve(stackids);
+    for (i = 0; i < growth.size(); i++) {
+        const SMTGrowth& g = growth[i];
+        fprintf(f, "GROWTH[%ld][+%ld blocks, +%ld bytes, now %ld blocks, %ld bytes] with BT:\n",
+            i+1, g.grewcount, g.grewbytes, g.count, g.bytes);
+        smtwriteframes(f, g.stackid);
+    }
+    SMTLOG("[%ld] stacks grew by [%ld] bytes over %.0fs, see [%s]\n", growth.size(), total, seconds, filepath);
+#if !USE_WTF_SYMBOLIZE
+    if (!growth.empty())
+        copymaps(filepath);
+#endif
+    fclose(f);
+    pthread_mutex_unlock(&reportlock);
+}
+
+// Copy the live counters of every stack into the ring, a read per stack
+// rather than a walk of the live table, then look for steady growth.
+static void smtsnapshot()
+{
+    if (!smtsnapshots)
+        smtsnapshots = new std::vector<SMTSnapshot>(smtsnapshotdepth);
+    SMTSnapshot& snapshot = (*smtsnapshots)[smtsnapshottaken % smtsnapshotdepth];
+    uint32_t n = smtdepot.size();
+    snapshot.counts.assign(n + 1, 0);
+    snapshot.bytes.assign(n + 1, 0);
+    clock_gettime(CLOCK_MONOTONIC, &snapshot.time);
+    for (uint32_t id = 1; id <= n; id++)
+        smtdepot.live(id, &snapshot.counts[id], &snapshot.bytes[id]);
+    smtsnapshottaken++;
+    if (smtsnapshottaken >= smtsnapshotdepth)
+        smtreportgrowth();
+}
+
+// async signal safe: only raise the flag and wake the dumper
+static void smtdumpsignal(int)
+{
+    int err = errno;
+    __atomic_store_n(&smtdumprequested, 1, __ATOMIC_RELEASE);
+    sem_post(&smtdumpsem);
+    errno = err;
+}
+
+static void* smtdumper(void*)
+{
+    struct timespec next;
+    use_origin_malloc = 1;
+    clock_gettime(CLOCK_REALTIME, &next);
+    next.tv_sec += smtsnapshotinterval;
+    for (;;) {
+        int err = 0;
+        if (smtsnapshotinterval ? sem_timedwait(&smtdumpsem, &next) : sem_wait(&smtdumpsem))
+            err = errno;
+        if (err == EINTR)
+            continue;
+        if (__atomic_load_n(&smtdumperstop, __ATOMIC_ACQUIRE))
+            break;
+        if (err == ETIMEDOUT) {
+            smtsnapshot();
+            next.tv_sec += smtsnapshotinterval;
+            continue;
+        }
+        if (__atomic_exchange_n(&smtdumprequested, 0, __ATOMIC_ACQ_REL)) {
+            smtdumpheap();
+            smtreportrates();
+        }
+    }
+    return 0;
+}
+
+static int smtstartdumperthread()
+{
+    int origin = use_origin_malloc;
+    use_origin_malloc = 1;
+    smtdumperstop = 0;
+    if (pthread_create(&smtdumperthread, 0, smtdumper, 0))
+        SMTLOG("*** fail to create heap dump thread\n");
+    else
+        smtdumperrunning = 1;
+    use_origin_malloc = origin;
+    return smtdumperrunning;
+}
+
+// from the constructor, only when a dump signal or snapshots were asked for
+static void smtstartdumper(int signo)
+{
+    struct sigaction sa;
+    if (sem_init(&smtdumpsem, 0, 0) || !smtstartdumperthread() || signo <= 0)
+        return;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = smtdumpsignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, 0))
+        SMTLOG("*** fail to handle signal %d for heap dumps\n", signo);
+}
+
+// the exchange makes one thread start it
+static void smtresumedumper()
+{
+    if (__atomic_load_n(&smtdumperwanted, __ATOMIC_ACQUIRE)
+        && __atomic_exchange_n(&smtdumperwanted, 0, __ATOMIC_ACQ_REL))
+        smtstartdumperthread();
+}
+
+static void smtstopdumper()
+{
+    __atomic_store_n(&smtdumperwanted, 0, __ATOMIC_RELEASE);
+    if (!smtdumperrunning)
+        return;
+    __atomic_store_n(&smtdumperstop, 1, __ATOMIC_RELEASE);
+    sem_post(&smtdumpsem);
+    pthread_join(smtdumperthread, 0);
+    smtdumperrunning = 0;
+}
+
+// apply or queue one event for smttable, 1 when a free was applied
+// right away and erased p, see smtapply()
+static int smtpublish(char c, void* p, size_t sz, uint32_t stackid, uint32_t epoch, uint64_t time, int kind,
+    MallocNode* freed)
+{
+    if (__atomic_load_n(&smtasync, __ATOMIC_ACQUIRE)
+        && smtpush(c, p, sz, stackid, epoch, time, kind, 0))
+        return 0;
+    return smtapply(c, p, sz, stackid, epoch, time, kind, freed);
+}
+
+static SMTLocalEntry& smtlocalentry(SMTLocalCache* cache, void* p)
+{
+    uint64_t h = (reinterpret_cast<uintptr_t>(p) >> 4) * 0x9E3779B97F4A7C15ULL;
+    return cache->entries[h >> 58];
+}
+
+// Counted before an entry is filled and after it is emptied: a thread
+// that frees p got it from the allocating thread after smtlocalput()
+// returned, so it sees the count of any cache still holding p.
+static uint32_t* smtlocalbucket(void* p)
+{
+    uint64_t h = (reinterpret_cast<uintptr_t>(p) >> 4) * 0x9E3779B97F4A7C15ULL;
+    return &smtlocalheld[(h >> 32) & (SMTLOCALBUCKETS - 1)];
+}
+
+// publish the allocation k cached in e, unless a free cancelled it first
+static void smtlocalpublish(SMTLocalEntry& e, void* k)
+{
+    void* busy = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(k) | 1);
+    if (!__atomic_compare_exchange_n(&e.p, &k, busy, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    smtpublish('+', k, e.sz, e.stackid, e.epoch, e.time, e.kind, 0);
+    __atomic_store_n(&e.p, (void*)0, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(smtlocalbucket(k), 1, __ATOMIC_RELEASE);
+}
+
+static SMTLocalCache* smtregisterlocal()
+{
+    SMTLocalCache* cache = 0;
+    pthread_mutex_lock(&locallock);
+    for (cache = smtlocalcaches; cache; cache = cache->next) {
+        if (cache->dead) {
+            cache->dead = 0;
+            break;
+        }
+    }
+    if (!cache) {
+        void* mem = mmap(0, sizeof(SMTLocalCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            cache = new (mem) SMTLocalCache();
+            cache->next = smtlocalcaches;
+            __atomic_store_n(&smtlocalcaches, cache, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&locallock);
+    if (cache) {
+        smtlocalcache = cache;
+        pthread_setspecific(smtlocalkey, cache);
+    }
+    return cache;
+}
+
+// cache a new allocation, publishing the one it evicts
+static int smtlocalput(void* p, size_t sz, uint32_t stackid, uint32_t epoch, uint64_t time, int kind)
+{
+    SMTLocalCache* cache = smtlocalcache ? smtlocalcache : smtregisterlocal();
+    if (!cache)
+        return 0;
+    SMTLocalEntry& e = smtlocalentry(cache, p);
+    void* k;
+    // only this thread turns an empty entry into a full one
+    while ((k = __atomic_load_n(&e.p, __ATOMIC_ACQUIRE))) {
+        if (reinterpret_cast<uintptr_t>(k) & 1)
+            sched_yield();
+        else
+            smtlocalpublish(e, k);
+    }
+    e.sz = sz;
+    e.stackid = stackid;
+    e.kind = kind;
+    e.epoch = epoch;
+    e.time = time;
+    __atomic_add_fetch(smtlocalbucket(p), 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e.p, p, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// 1 when p was cached in cache and is dropped now, its entry copied to
+// *dropped, 0 when it was being published (waited for here), -1 when
+// cache does not hold p
+static int smtlocaldrop(SMTLocalCache* cache, void* p, SMTLocalEntry* dropped)
+{
+    void* busy = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(p) | 1);
+    SMTLocalEntry& e = smtlocalentry(cache, p);
+    void* k = __atomic_load_n(&e.p, __ATOMIC_ACQUIRE);
+    // read before the entry is released to its owner for reuse
+    SMTLocalEntry copy = e;
+    if (k == p && __atomic_compare_exchange_n(&e.p, &k, (void*)0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_sub_fetch(smtlocalbucket(p), 1, __ATOMIC_RELEASE);
+        *dropped = copy;
+        return 1;
+    }
+    if (k != busy)
+        return -1;
+    while (__atomic_load_n(&e.p, __ATOMIC_ACQUIRE) == busy)
+        sched_yield();
+    return 0;
+}
+
+// Drop a cached allocation being freed, copying its entry to *dropped.
+// Returns 0 when no cache holds p, then the free must go to smttable:
+// either p was never cached, or its publication has already been applied
+// or queued.
+static int smtlocalcancel(void* p, SMTLocalEntry* dropped)
+{
+    SMTLocalCache* own = smtlocalcache;
+    SMTLocalCache* cache;
+    int r;
+    // this thread's cache first, it holds p for most frees
+    if (own && (r = smtlocaldrop(own, p, dropped)) >= 0)
+        return r;
+    if (!__atomic_load_n(smtlocalbucket(p), __ATOMIC_ACQUIRE))
+        return 0;
+    for (cache = __atomic_load_n(&smtlocalcaches, __ATOMIC_ACQUIRE); cache; cache = cache->next) {
+        if (cache != own && (r = smtlocaldrop(cache, p, dropped)) >= 0)
+            return r;
+    }
+    return 0;
+}
+
+// publish everything cached by every thread, before a report
+static void smtlocalflush()
+{
+    SMTLocalCache* cache;
+    for (cache = __atomic_load_n(&smtlocalcaches, __ATOMIC_ACQUIRE); cache; cache = cache->next) {
+        for (size_t i = 0; i < SMTLOCALSZ; i++) {
+            SMTLocalEntry& e = cache->entries[i];
+            void* k = __atomic_load_n(&e.p, __ATOMIC_ACQUIRE);
+            if (k && !(reinterpret_cast<uintptr_t>(k) & 1))
+                smtlocalpublish(e, k);
+        }
+    }
+}
+
+// thread exit: publish what is still cached and recycle the cache
+static void smtlocalexit(void* arg)
+{
+    SMTLocalCache* cache = static_cast<SMTLocalCache*>(arg);
+    int origin = use_origin_malloc;
+    use_origin_malloc = 1;
+    for (size_t i = 0; i < SMTLOCALSZ; i++) {
+        void* k = __atomic_load_n(&cache->entries[i].p, __ATOMIC_ACQUIRE);
+        if (k && !(reinterpret_cast<uintptr_t>(k) & 1))
+            smtlocalpublish(cache->entries[i], k);
+    }
+    smtlocalcache = 0;
+    pthread_mutex_lock(&locallock);
+    cache->dead = 1;
+    pthread_mutex_unlock(&locallock);
+    use_origin_malloc = origin;
+}
+
+// c is '+' for an allocation, '-' for a free, kind is SMTKIND*.  sz of a
+// free is what a sized delete passed, 0 for every other free.  Never
+// inlined, the stacks start past tr_where() and the hook that called it.
+// realloc() passes undo with its free, see SMTRealloc.
+void __attribute__((noinline)) tr_where(char c, void* p, size_t sz, int kind, SMTRealloc* undo = 0)
+{
+    void* bt[SMTMAXDEPTH + 2];
+    size_t btsz = 0;
+    uint32_t stackid = 0;
+    uint32_t epoch = __atomic_load_n(&smtepoch, __ATOMIC_ACQUIRE);
+    SMTLocalEntry cached;
+    MallocNode freed;
+    int found = 0;
+    if (!__atomic_load_n(&smttable, __ATOMIC_ACQUIRE))
+        return;
+    uint64_t now = smtlifetimes ? smtclock() : 0;
+    use_origin_malloc = 1;
+    // skip tr_where() and the hook itself
+    if (c == '+') {
+        btsz = smtfpunwind ? fpbacktrace(bt, smtdepth + 2) : backtrace(bt, smtdepth + 2);
+        if (btsz > 2)
+            stackid = smtdepot.put(bt+2, btsz - 2);
+        if (smtrates)
+            smtcountalloc(stackid, sz);
+        if (smtsizes)
+            smtcountcallsite(stackid, sz);
+        // after unwinding, so that lifetimes leave out the tracker's own time
+        if (smtlifetimes)
+            now = smtclock();
+        if (!smtlocal || !smtlocalput(p, sz, stackid, epoch, now, kind))
+            smtpublish(c, p, sz, stackid, epoch, now, kind, 0);
+    } else if (smtlocal && smtlocalcancel(p, &cached)) {
+        if (smtrates)
+            smtcountfree(cached.stackid);
+        if (smtlifetimes)
+            smtcountlifetime(cached.stackid, cached.time, now);
+        freed = MallocNode(cached.sz, cached.stackid, cached.epoch, cached.time, cached.kind);
+        found = 1;
+    } else if (undo && __atomic_load_n(&smtasync, __ATOMIC_ACQUIRE) && smtreserve(&undo->seq)) {
+        // pushed by smtrealloced(), the erased entry is never seen here
+        undo->reserved = 1;
+    } else {
+        found = smtpublish(c, p, sz, stackid, epoch, now, kind, &freed);
+    }
+    if (undo && found) {
+        undo->node = freed;
+        undo->found = 1;
+    }
+    // unwinding a free is only worth it for a mismatch
+    if (found && smtmismatched(freed.kind, freed.sz, kind, sz)) {
+        btsz = smtfpunwind ? fpbacktrace(bt, smtdepth + 2) : backtrace(bt, smtdepth + 2);
+        if (btsz > 2)
+            stackid = smtdepot.put(bt+2, btsz - 2);
+        smtmismatch(freed.stackid, freed.kind, kind, freed.kind == kind, stackid);
+    }
+    use_origin_malloc = 0;
+}
+
+// libc answered the realloc() of p whose free tr_where() saw in undo:
+// push the free it left for later, or track p again when libc failed
+static void smtrealloced(void* p, int failed, SMTRealloc* undo)
+{
+    int origin = use_origin_malloc;
+    use_origin_malloc = 1;
+    if (undo->reserved)
+        smtpush(failed ? '.' : '-', p, 0, 0, 0, smtlifetimes ? smtclock() : 0, SMTKINDMALLOC, &undo->seq);
+    else if (failed && undo->found)
+        smtpublish('+', p, undo->node.sz, undo->node.stackid, undo->node.epoch, undo->node.time, undo->node.kind, 0);
+    use_origin_malloc = origin;
+}
+
+SMTEXPORT void* malloc(size_t sz)
+{
+    void* r = 0;
+    if (!libc_malloc) {
+        SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
+        malloc_hook();
+    }
+    r = libc_malloc(sz);
+    if (!use_origin_malloc && r && smtsampleat(SMTHOOKMALLOC, sz)) {
+        tr_where('+', r, sz, SMTKINDMALLOC);
+    }
+    return r;
+}
+
+SMTEXPORT void* realloc(void* p, size_t sz)
+{
+    void* r = 0;
+    SMTRealloc undo;
+    if (!libc_realloc) {
+        SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
+        malloc_hook();
+    }
+    // like free(): forget p before libc can hand it to another thread,
+    // and track it again when libc fails to resize it
+    if (p && !use_origin_malloc)
+        tr_where('-', p, 0, SMTKINDMALLOC, &undo);
+    r = libc_realloc(p, sz);
+    if (p && !use_origin_malloc)
+        smtrealloced(p, !r && sz, &undo);
+    // also when r == p, the block has a new size and a new stack
+    if (!use_origin_malloc && r && smtsampleat(SMTHOOKREALLOC, sz)) {
+        tr_where('+', r, sz, SMTKINDMALLOC);
+    }
+    return r;
+}
+
+static void* static_calloc(size_t size)
+{
+    static char memory_pool[1024] = {0, };
+    static size_t pool_index = 0;
     void* r = 0;
     if (size % 8)
         size += size % 8;
@@ -538,7 +2825,7 @@ static void* static_calloc(size_t size)
     return r;
 }
 
-void* calloc(size_t nitems, size_t size)
+SMTEXPORT void* calloc(size_t nitems, size_t size)
 {
     void* r = 0;
     if (!libc_calloc) {
@@ -548,12 +2835,12 @@ void* calloc(size_t nitems, size_t size)
         malloc_hook();
     }
     r = libc_calloc(nitems, size);
-    if (!use_origin_malloc && r)
-        tr_where('+', r, nitems*size);
+    if (!use_origin_malloc && r && smtsampleat(SMTHOOKCALLOC, nitems*size))
+        tr_where('+', r, nitems*size, SMTKINDMALLOC);
     return r;
 }
 
-int posix_memalign(void **memptr, size_t alignment, size_t size)
+SMTEXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
     int r;
     if (!libc_posix_memalign) {
@@ -561,12 +2848,12 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
         malloc_hook();
     }
     r = libc_posix_memalign(memptr, alignment, size);
-    if (!use_origin_malloc && *memptr)
-        tr_where('+', *memptr, size);
+    if (!use_origin_malloc && !r && *memptr && smtsampleat(SMTHOOKPOSIXMEMALIGN, size))
+        tr_where('+', *memptr, size, SMTKINDMALLOC);
     return r;
 }
 
-void *aligned_alloc(size_t alignment, size_t size)
+SMTEXPORT void *aligned_alloc(size_t alignment, size_t size)
 {
     void* r = 0;
     if (!libc_aligned_alloc) {
@@ -574,12 +2861,12 @@ void *aligned_alloc(size_t alignment, size_t size)
         malloc_hook();
     }
     r = libc_aligned_alloc(alignment, size);
-    if (!use_origin_malloc && r)
-        tr_where('+', r, size);
+    if (!use_origin_malloc && r && smtsampleat(SMTHOOKALIGNEDALLOC, size))
+        tr_where('+', r, size, SMTKINDMALLOC);
     return r;
 }
 
-void *memalign(size_t alignment, size_t size)
+SMTEXPORT void *memalign(size_t alignment, size_t size)
 {
     void* r = 0;
     if (!libc_memalign) {
@@ -588,59 +2875,65 @@ void *memalign(size_t alignment, size_t size)
         sem_wait(&smtinit_sem);
     }
     r = libc_memalign(alignment, size);
-    if (!use_origin_malloc && r)
-        tr_where('+', r, size);
+    if (!use_origin_malloc && r && smtsampleat(SMTHOOKMEMALIGN, size))
+        tr_where('+', r, size, SMTKINDMALLOC);
     return r;
 }
 
-void free(void* p)
+SMTEXPORT void free(void* p)
 {
     if (p) {
         if (!libc_free) {
             SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
             malloc_hook();
         }
-        libc_free(p);
+        // forget p before libc can hand it to another thread
         if (!use_origin_malloc)
-            tr_where('-', p, 0);
+            tr_where('-', p, 0, SMTKINDMALLOC);
+        libc_free(p);
     }
 }
 
-void cfree(void* p)
+SMTEXPORT void cfree(void* p)
 {
     if (p) {
         if (!libc_cfree) {
             SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
             malloc_hook();
         }
-        libc_cfree(p);
+        // forget p before libc can hand it to another thread
         if (!use_origin_malloc)
-            tr_where('-', p, 0);
+            tr_where('-', p, 0, SMTKINDMALLOC);
+        libc_cfree(p);
     }
 }
 
-size_t smtstart(const char* file, const char* function, size_t line)
+SMTEXPORT size_t smtstart(const char* file, const char* function, size_t line)
 {
     size_t index = -1;
     SMTLOG("start simple trace malloc from [%s, %s, %ld]\n", file, function, line);
+    smtresumedumper();
     if (smtmaplist) {
         use_origin_malloc = 1;
-        SMTMap* smtmap = new SMTMap(file, function, line);
+        pthread_mutex_lock(&maplock);
+        // allocations from now on carry an epoch >= the scope's
+        uint32_t epoch = __atomic_add_fetch(&smtepoch, 1, __ATOMIC_ACQ_REL);
+        SMTMap* smtmap = new SMTMap(file, function, line, epoch);
         if (smtmap) {
-            pthread_mutex_lock(&maplock);
             smtmaplist->push_back(smtmap);
             index = smtmaplist->size() - 1;
-            pthread_mutex_unlock(&maplock);
         }
+        pthread_mutex_unlock(&maplock);
         use_origin_malloc = 0;
     }
     return index;
 }
 
-void smtstop(size_t index, const char* file, const char* function, size_t line)
+SMTEXPORT void smtstop(size_t index, const char* file, const char* function, size_t line)
 {
     SMTLOG("stop simple trace malloc from [%s, %s, %ld]\n", file, function, line);
     SMTMap* smtmap = 0;
+    smtresumedumper();
     pthread_mutex_lock(&maplock);
     if (!smtmaplist || index >= smtmaplist->size()  || !(smtmap = (*smtmaplist)[index])) {
         pthread_mutex_unlock(&maplock);
@@ -651,12 +2944,176 @@ void smtstop(size_t index, const char* file, const char* function, size_t line)
     SMTLOG("Let's detect memory leak\n");
     SMTLOG("From [%s %s %ld]\n", smtmap->startfile, smtmap->startfunction, smtmap->startline);
     SMTLOG("To [%s %s %ld]\n", file, function, line);
-    smtmap->stopAt(file, function, line);
-    detectmemoryleak(smtmap);
+    // the report walks the live table, keep its own allocations out of it
     use_origin_malloc = 1;
+    smtmap->stopAt(file, function, line);
+    smtlocalflush();
+    smtflush();
+    detectmemoryleak(__atomic_load_n(&smttable, __ATOMIC_ACQUIRE), smtmap);
     delete smtmap;
     smtmap = 0;
     use_origin_malloc = 0;
 }
 
 }
+
+// The global operator new and delete.  They call libc themselves rather
+// than malloc() and free(), so that the stack of a block starts at the
+// new expression instead of inside libstdc++, and every block remembers
+// which operator allocated it for the mismatch checks.  smtnew() and
+// smtdelete() are always inlined: tr_where() is then called from the
+// operator and skips it like it skips the malloc hooks.
+
+static inline __attribute__((always_inline)) void* smtnew(size_t sz, size_t alignment, int kind, int hook)
+{
+    void* r = 0;
+    if (!libc_malloc) {
+        SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
+        malloc_hook();
+    }
+    // like the operator new of libstdc++: zero bytes still make a unique
+    // pointer, and the new handler runs until memory is found
+    while (!(r = alignment ? libc_memalign(alignment, sz ? sz : 1) : libc_malloc(sz ? sz : 1))) {
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+    if (!use_origin_malloc && smtsampleat(hook, sz))
+        tr_where('+', r, sz, kind);
+    return r;
+}
+
+// sz is what a sized delete passed, 0 for the others
+static inline __attribute__((always_inline)) void smtdelete(void* p, size_t sz, int kind)
+{
+    if (p) {
+        if (!libc_free) {
+            SMTLOG("wait for smtinit_sem %s %d\n", __FUNCTION__, __LINE__);
+            malloc_hook();
+        }
+        // forget p before libc can hand it to another thread
+        if (!use_origin_malloc)
+            tr_where('-', p, sz, kind);
+        libc_free(p);
+    }
+}
+
+SMTEXPORT void* operator new(size_t sz)
+{
+    return smtnew(sz, 0, SMTKINDNEW, SMTHOOKNEW);
+}
+
+SMTEXPORT void* operator new[](size_t sz)
+{
+    return smtnew(sz, 0, SMTKINDNEWARRAY, SMTHOOKNEWARRAY);
+}
+
+SMTEXPORT void* operator new(size_t sz, const std::nothrow_t&) noexcept
+{
+    try {
+        return smtnew(sz, 0, SMTKINDNEW, SMTHOOKNEW);
+    } catch (...) {
+        return 0;
+    }
+}
+
+SMTEXPORT void* operator new[](size_t sz, const std::nothrow_t&) noexcept
+{
+    try {
+        return smtnew(sz, 0, SMTKINDNEWARRAY, SMTHOOKNEWARRAY);
+    } catch (...) {
+        return 0;
+    }
+}
+
+SMTEXPORT void operator delete(void* p) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEW);
+}
+
+SMTEXPORT void operator delete[](void* p) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEWARRAY);
+}
+
+SMTEXPORT void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEW);
+}
+
+SMTEXPORT void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEWARRAY);
+}
+
+// the size is already in smttable, a sized delete only checks it
+SMTEXPORT void operator delete(void* p, size_t sz) noexcept
+{
+    smtdelete(p, sz, SMTKINDNEW);
+}
+
+SMTEXPORT void operator delete[](void* p, size_t sz) noexcept
+{
+    smtdelete(p, sz, SMTKINDNEWARRAY);
+}
+
+#if __cpp_aligned_new
+SMTEXPORT void* operator new(size_t sz, std::align_val_t alignment)
+{
+    return smtnew(sz, static_cast<size_t>(alignment), SMTKINDNEWALIGNED, SMTHOOKNEW);
+}
+
+SMTEXPORT void* operator new[](size_t sz, std::align_val_t alignment)
+{
+    return smtnew(sz, static_cast<size_t>(alignment), SMTKINDNEWARRAYALIGNED, SMTHOOKNEWARRAY);
+}
+
+SMTEXPORT void* operator new(size_t sz, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    try {
+        return smtnew(sz, static_cast<size_t>(alignment), SMTKINDNEWALIGNED, SMTHOOKNEW);
+    } catch (...) {
+        return 0;
+    }
+}
+
+SMTEXPORT void* operator new[](size_t sz, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    try {
+        return smtnew(sz, static_cast<size_t>(alignment), SMTKINDNEWARRAYALIGNED, SMTHOOKNEWARRAY);
+    } catch (...) {
+        return 0;
+    }
+}
+
+SMTEXPORT void operator delete(void* p, std::align_val_t) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEWALIGNED);
+}
+
+SMTEXPORT void operator delete[](void* p, std::align_val_t) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEWARRAYALIGNED);
+}
+
+SMTEXPORT void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEWALIGNED);
+}
+
+SMTEXPORT void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    smtdelete(p, 0, SMTKINDNEWARRAYALIGNED);
+}
+
+SMTEXPORT void operator delete(void* p, size_t sz, std::align_val_t) noexcept
+{
+    smtdelete(p, sz, SMTKINDNEWALIGNED);
+}
+
+SMTEXPORT void operator delete[](void* p, size_t sz, std::align_val_t) noexcept
+{
+    smtdelete(p, sz, SMTKINDNEWARRAYALIGNED);
+}
+#endif
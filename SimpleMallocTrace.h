@@ -1,10 +1,14 @@
 #ifndef _SimpleMallocTrace_h
 #define _SimpleMallocTrace_h
 
+// the only symbols libsimplemalloctrace.so exports, besides the malloc
+// functions it replaces
+#define SMTEXPORT __attribute__((visibility("default")))
+
 extern "C" {
 
-size_t smtstart(const char* file, const char* function, size_t line);
-void smtstop(size_t, const char* file, const char* function, size_t line);
+SMTEXPORT size_t smtstart(const char* file, const char* function, size_t line);
+SMTEXPORT void smtstop(size_t, const char* file, const char* function, size_t line);
 
 }
 
@@ -0,0 +1,193 @@
+#include "StackDepot.h"
+
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define LOCKBIT ((uintptr_t)1)
+
+static uint32_t hashframes(void* const* frames, size_t depth)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ depth;
+    for (size_t i = 0; i < depth; i++) {
+        h ^= reinterpret_cast<uintptr_t>(frames[i]);
+        h *= 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static void* mapanon(size_t sz)
+{
+    void* p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+static void spinlock(int* lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+static void spinunlock(int* lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+StackDepot::Record* StackDepot::find(Record* head, uint32_t hash, void* const* frames, size_t depth)
+{
+    for (Record* r = head; r; r = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE)) {
+        if (r->hash == hash && r->depth == depth
+            && !memcmp(r->frames, frames, depth * sizeof(void*)))
+            return r;
+    }
+    return 0;
+}
+
+// bump-allocate a record, caller holds arenalock
+StackDepot::Record* StackDepot::allocate(size_t depth)
+{
+    size_t sz = sizeof(Record) + (depth ? depth - 1 : 0) * sizeof(void*);
+    sz = (sz + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (!chunk || chunkused + sz > SDCHUNKSZ) {
+        chunk = static_cast<char*>(mapanon(SDCHUNKSZ));
+        chunkused = 0;
+        if (!chunk)
+            return 0;
+    }
+    Record* r = reinterpret_cast<Record*>(chunk + chunkused);
+    chunkused += sz;
+    return r;
+}
+
+// make id resolvable by get(), caller holds arenalock
+bool StackDepot::map(uint32_t id, Record* record)
+{
+    size_t page = id >> SDPAGESHIFT;
+    if (page >= SDPAGES)
+        return false;
+    if (!pages[page]) {
+        Record** p = static_cast<Record**>(mapanon(sizeof(Record*) << SDPAGESHIFT));
+        if (!p)
+            return false;
+        __atomic_store_n(&pages[page], p, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&pages[page][id & ((1 << SDPAGESHIFT) - 1)], record, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint32_t StackDepot::put(void* const* frames, size_t depth)
+{
+    if (!depth)
+        return 0;
+    uint32_t hash = hashframes(frames, depth);
+    Record** bucket = &buckets[hash & (SDBUCKETS - 1)];
+
+    // fast path: the stack is already known
+    uintptr_t head = reinterpret_cast<uintptr_t>(__atomic_load_n(bucket, __ATOMIC_ACQUIRE));
+    Record* r = find(reinterpret_cast<Record*>(head & ~LOCKBIT), hash, frames, depth);
+    if (r)
+        return r->id;
+
+    // take the bucket's lock bit, then look again for a racing insert
+    for (;;) {
+        head = reinterpret_cast<uintptr_t>(__atomic_load_n(bucket, __ATOMIC_RELAXED));
+        if (head & LOCKBIT) {
+            sched_yield();
+            continue;
+        }
+        Record* expected = reinterpret_cast<Record*>(head);
+        if (__atomic_compare_exchange_n(bucket, &expected, reinterpret_cast<Record*>(head | LOCKBIT),
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    r = find(reinterpret_cast<Record*>(head), hash, frames, depth);
+    if (!r) {
+        spinlock(&arenalock);
+        r = allocate(depth);
+        if (r) {
+            r->next = reinterpret_cast<Record*>(head);
+            r->id = lastid + 1;
+            r->hash = hash;
+            r->depth = depth;
+            r->livecount = 0;
+            r->livebytes = 0;
+            memcpy(r->frames, frames, depth * sizeof(void*));
+            if (map(r->id, r))
+                __atomic_store_n(&lastid, r->id, __ATOMIC_RELEASE);
+            else
+                r = 0;
+        }
+        spinunlock(&arenalock);
+        if (r)
+            head = reinterpret_cast<uintptr_t>(r);
+    }
+    // publishing the new head also drops the lock bit
+    __atomic_store_n(bucket, reinterpret_cast<Record*>(head), __ATOMIC_RELEASE);
+    return r ? r->id : 0;
+}
+
+StackDepot::Record* StackDepot::record(uint32_t id)
+{
+    size_t page = id >> SDPAGESHIFT;
+    Record** p;
+    if (!id || page >= SDPAGES || !(p = __atomic_load_n(&pages[page], __ATOMIC_ACQUIRE)))
+        return 0;
+    return __atomic_load_n(&p[id & ((1 << SDPAGESHIFT) - 1)], __ATOMIC_ACQUIRE);
+}
+
+void* const* StackDepot::get(uint32_t id, size_t* depth)
+{
+    Record* r = record(id);
+    *depth = 0;
+    if (!r)
+        return 0;
+    *depth = r->depth;
+    return r->frames;
+}
+
+void StackDepot::account(uint32_t id, intptr_t count, intptr_t bytes)
+{
+    Record* r = record(id);
+    if (!r)
+        return;
+    __atomic_fetch_add(&r->livecount, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&r->livebytes, bytes, __ATOMIC_RELAXED);
+}
+
+bool StackDepot::live(uint32_t id, intptr_t* count, intptr_t* bytes)
+{
+    Record* r = record(id);
+    if (!r)
+        return false;
+    *count = __atomic_load_n(&r->livecount, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&r->livebytes, __ATOMIC_RELAXED);
+    return true;
+}
+
+void StackDepot::resetlive()
+{
+    uint32_t n = size();
+    for (uint32_t id = 1; id <= n; id++) {
+        Record* r = record(id);
+        if (r) {
+            __atomic_store_n(&r->livecount, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->livebytes, 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+uint32_t StackDepot::size()
+{
+    return __atomic_load_n(&lastid, __ATOMIC_ACQUIRE);
+}
+
+void StackDepot::afterfork()
+{
+    arenalock = 0;
+    for (size_t i = 0; i < SDBUCKETS; i++) {
+        uintptr_t head = reinterpret_cast<uintptr_t>(buckets[i]);
+        if (head & LOCKBIT)
+            buckets[i] = reinterpret_cast<Record*>(head & ~LOCKBIT);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef _StackDepot_h
+#define _StackDepot_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only, hash-consed store of backtraces.
+//
+// put() returns the same 32-bit id for the same frames, so callers keep
+// an id per allocation instead of a copy of the frames.  Stacks are
+// never removed: records are carved out of mmap'd chunks and chained
+// into a fixed array of hash buckets.  Lookups walk a chain without any
+// lock; only publishing a new stack takes the bucket's lock bit.
+//
+// Each stack also carries counters of the live blocks and bytes charged
+// to it, which account() updates with atomic adds.
+//
+// A zero-filled StackDepot is a valid empty depot, so a static instance
+// can be used by malloc hooks that run before static constructors.
+
+#define SDBUCKETS (1 << 18)
+#define SDPAGESHIFT 12
+#define SDPAGES 1024
+#define SDCHUNKSZ (1 << 20)
+
+class StackDepot {
+public:
+    // id of the given frames, interning them first if needed.  Id 0 is
+    // the empty stack and is also returned when the depot is full.
+    uint32_t put(void* const* frames, size_t depth);
+    // frames of a stack returned by put(), 0 for id 0 or unknown ids
+    void* const* get(uint32_t id, size_t* depth);
+    // ids handed out so far are 1..size()
+    uint32_t size();
+    // add count blocks and bytes bytes (either may be negative) to the
+    // live counters of a stack
+    void account(uint32_t id, intptr_t count, intptr_t bytes);
+    // live counters of a stack, false for id 0 or unknown ids
+    bool live(uint32_t id, intptr_t* count, intptr_t* bytes);
+    // zero the live counters of every stack
+    void resetlive();
+    // reset lock state left behind by threads lost across fork()
+    void afterfork();
+
+private:
+    class Record {
+    public:
+        Record* next;
+        uint32_t id;
+        uint32_t hash;
+        uint32_t depth;
+        intptr_t livecount;
+        intptr_t livebytes;
+        void* frames[1];
+    };
+
+    Record* find(Record* head, uint32_t hash, void* const* frames, size_t depth);
+    Record* allocate(size_t depth);
+    bool map(uint32_t id, Record* record);
+    Record* record(uint32_t id);
+
+    Record* buckets[SDBUCKETS];
+    Record** pages[SDPAGES];
+    uint32_t lastid;
+    int arenalock;
+    char* chunk;
+    size_t chunkused;
+};
+
+#endif // _StackDepot_h
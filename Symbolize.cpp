@@ -52,6 +52,7 @@
 
 #include "Demangle.h"
 
+#include <algorithm>
 #include <dlfcn.h>
 #include <elf.h>
 #include <errno.h>
@@ -64,6 +65,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -195,14 +197,30 @@ static ssize_t ReadPersistent(const int fd, void *buf, const size_t count) {
 
 // Read up to "count" bytes from "offset" in the file pointed by file
 // descriptor "fd" into the buffer starting at "buf".  On success,
-// return the number of bytes read.  Otherwise, return -1.
+// return the number of bytes read.  Otherwise, return -1.  pread()
+// leaves the file position alone, so an fd kept by a SymbolizeSession
+// carries no state between reads.
 static ssize_t ReadFromOffset(const int fd, void *buf,
                               const size_t count, const off_t offset) {
-  off_t off = lseek(fd, offset, SEEK_SET);
-  if (off == (off_t)-1) {
-    return -1;
+  SAFE_ASSERT(fd >= 0);
+  SAFE_ASSERT(count <= static_cast<size_t>(std::numeric_limits<ssize_t>::max()));
+  const ssize_t total = static_cast<ssize_t>(count);
+  char *buf0 = reinterpret_cast<char *>(buf);
+  ssize_t num_bytes = 0;
+  while (num_bytes < total) {
+    ssize_t len;
+    NO_INTR(len = pread(fd, buf0 + num_bytes, total - num_bytes,
+                        offset + num_bytes));
+    if (len < 0) {  // There was an error other than EINTR.
+      return -1;
+    }
+    if (len == 0) {  // Reached EOF.
+      break;
+    }
+    num_bytes += len;
   }
-  return ReadPersistent(fd, buf, count);
+  SAFE_ASSERT(num_bytes <= total);
+  return num_bytes;
 }
 
 // Try reading exactly "count" bytes from "offset" bytes in a file
@@ -326,6 +344,68 @@ static char *GetHex(const char *start, const char *end, uint64_t *hex) {
   return const_cast<char *>(p);
 }
 
+// Parse one line of /proc/self/maps.  Here is an example:
+//
+// 08048000-0804c000 r-xp 00000000 08:01 2142121    /bin/cat
+//
+// We want start address (08048000), end address (0804c000), flags
+// (r-xp), file offset (00000000) and file name (/bin/cat).  "name" is
+// left pointing at "eol" when the mapping has no file.  Returns false
+// for a malformed line.
+static bool ParseMapsLine(const char *cursor, const char *eol,
+                          uint64_t *start_address, uint64_t *end_address,
+                          const char **flags, uint64_t *file_offset,
+                          const char **name) {
+  // Read start address.
+  cursor = GetHex(cursor, eol, start_address);
+  if (cursor == eol || *cursor != '-') {
+    return false;  // Malformed line.
+  }
+  ++cursor;  // Skip '-'.
+
+  // Read end address.
+  cursor = GetHex(cursor, eol, end_address);
+  if (cursor == eol || *cursor != ' ') {
+    return false;  // Malformed line.
+  }
+  ++cursor;  // Skip ' '.
+
+  // Read flags.  Skip flags until we encounter a space or eol.
+  const char * const flags_start = cursor;
+  while (cursor < eol && *cursor != ' ') {
+    ++cursor;
+  }
+  // We expect at least four letters for flags (ex. "r-xp").
+  if (cursor == eol || cursor < flags_start + 4) {
+    return false;  // Malformed line.
+  }
+  *flags = flags_start;
+  ++cursor;  // Skip ' '.
+
+  // Read file offset.
+  cursor = GetHex(cursor, eol, file_offset);
+  if (cursor == eol || *cursor != ' ') {
+    return false;  // Malformed line.
+  }
+  ++cursor;  // Skip ' '.
+
+  // Skip to file name.  "cursor" now points to dev.  We need to
+  // skip at least two spaces for dev and inode.
+  int num_spaces = 0;
+  while (cursor < eol) {
+    if (*cursor == ' ') {
+      ++num_spaces;
+    } else if (num_spaces >= 2) {
+      // The first non-space character after skipping two spaces
+      // is the beginning of the file name.
+      break;
+    }
+    ++cursor;
+  }
+  *name = cursor;
+  return true;
+}
+
 static int
 OpenObjectFileContainingPcAndGetStartAddress(uint64_t pc,
                                              uint64_t &start_address,
@@ -355,56 +435,24 @@ OpenObjectFileContainingPcAndGetStartAddress(uint64_t pc,
       return -1;
     }
 
-    // Start parsing line in /proc/self/maps.  Here is an example:
-    //
-    // 08048000-0804c000 r-xp 00000000 08:01 2142121    /bin/cat
-    //
-    // We want start address (08048000), end address (0804c000), flags
-    // (r-xp) and file name (/bin/cat).
-
-    // Read start address.
-    cursor = GetHex(cursor, eol, &start_address);
-    if (cursor == eol || *cursor != '-') {
-      return -1;  // Malformed line.
-    }
-    ++cursor;  // Skip '-'.
-
-    // Read end address.
     uint64_t end_address;
-    cursor = GetHex(cursor, eol, &end_address);
-    if (cursor == eol || *cursor != ' ') {
+    const char *flags;
+    uint64_t file_offset;
+    const char *name;
+    if (!ParseMapsLine(cursor, eol, &start_address, &end_address,
+                       &flags, &file_offset, &name)) {
       return -1;  // Malformed line.
     }
-    ++cursor;  // Skip ' '.
 
     // Check start and end addresses.
     if (!(start_address <= pc && pc < end_address)) {
       continue;  // We skip this map.  PC isn't in this map.
     }
 
-    // Read flags.  Skip flags until we encounter a space or eol.
-    const char * const flags_start = cursor;
-    while (cursor < eol && *cursor != ' ') {
-      ++cursor;
-    }
-    // We expect at least four letters for flags (ex. "r-xp").
-    if (cursor == eol || cursor < flags_start + 4) {
-      return -1;  // Malformed line.
-    }
-
     // Check flags.  We are only interested in "r-x" maps.
-    if (memcmp(flags_start, "r-x", 3) != 0) {  // Not a "r-x" map.
+    if (memcmp(flags, "r-x", 3) != 0) {  // Not a "r-x" map.
       continue;  // We skip this map.
     }
-    ++cursor;  // Skip ' '.
-
-    // Read file offset.
-    uint64_t file_offset;
-    cursor = GetHex(cursor, eol, &file_offset);
-    if (cursor == eol || *cursor != ' ') {
-      return -1;  // Malformed line.
-    }
-    ++cursor;  // Skip ' '.
 
     // Don't subtract 'start_address' from the first entry:
     // * If a binary is compiled w/o -pie, then the first entry in
@@ -418,30 +466,20 @@ OpenObjectFileContainingPcAndGetStartAddress(uint64_t pc,
     //   shadow memory of the tool), so the module can't be the
     //   first entry.
     base_address = ((num_maps == 1) ? 0U : start_address) - file_offset;
+    // Text is not always mapped from offset 0 (ld splits r-- and r-x
+    // segments), symbol values are relative to where offset 0 would be.
+    start_address -= file_offset;
 
-    // Skip to file name.  "cursor" now points to dev.  We need to
-    // skip at least two spaces for dev and inode.
-    int num_spaces = 0;
-    while (cursor < eol) {
-      if (*cursor == ' ') {
-        ++num_spaces;
-      } else if (num_spaces >= 2) {
-        // The first non-space character after skipping two spaces
-        // is the beginning of the file name.
-        break;
-      }
-      ++cursor;
-    }
-    if (cursor == eol) {
+    if (name == eol) {
       return -1;  // Malformed line.
     }
 
-    // Finally, "cursor" now points to file name of our interest.
-    NO_INTR(object_fd = open(cursor, O_RDONLY));
+    // Finally, "name" now points to file name of our interest.
+    NO_INTR(object_fd = open(name, O_RDONLY));
     if (object_fd < 0) {
       // Failed to open object file.  Copy the object file name to
       // |out_file_name|.
-      strncpy(out_file_name, cursor, out_file_name_size);
+      strncpy(out_file_name, name, out_file_name_size);
       // Making sure |out_file_name| is always null-terminated.
       out_file_name[out_file_name_size - 1] = '\0';
       return -1;
@@ -522,51 +560,869 @@ FindSymbol(uint64_t pc, const int fd, char *out, int out_size,
   return false;
 }
 
-static bool GetSymbolFromObjectFile(const int fd, uint64_t pc,
-                                    char *out, int out_size,
-                                    uint64_t map_start_address) {
+// Section headers of an object's symbol tables, all FindSymbol() needs.
+struct SymbolTables {
+  int elf_type;
+  // Where the section headers are, for looking sections up by name.
+  ElfW(Off) shoff;
+  ElfW(Half) shnum;
+  ElfW(Half) shstrndx;
+  bool has_symtab;
+  ElfW(Shdr) symtab, strtab;
+  bool has_dynsym;
+  ElfW(Shdr) dynsym, dynstr;
+};
+
+static bool ReadSymbolTables(const int fd, SymbolTables *tables) {
   // Read the ELF header.
   ElfW(Ehdr) elf_header;
   if (!ReadFromOffsetExact(fd, &elf_header, sizeof(elf_header), 0)) {
     return false;
   }
+  if (memcmp(elf_header.e_ident, ELFMAG, SELFMAG) != 0) {
+    return false;
+  }
+  tables->elf_type = elf_header.e_type;
+  tables->shoff = elf_header.e_shoff;
+  tables->shnum = elf_header.e_shnum;
+  tables->shstrndx = elf_header.e_shstrndx;
+
+  // A regular symbol table, if the binary is not stripped.
+  tables->has_symtab = GetSectionHeaderByType(fd, elf_header.e_shnum,
+                                              elf_header.e_shoff, SHT_SYMTAB,
+                                              &tables->symtab);
+  if (tables->has_symtab &&
+      !ReadFromOffsetExact(fd, &tables->strtab, sizeof(tables->strtab),
+                           elf_header.e_shoff + tables->symtab.sh_link *
+                           sizeof(tables->symtab))) {
+    return false;
+  }
+
+  // And the dynamic symbol table.
+  tables->has_dynsym = GetSectionHeaderByType(fd, elf_header.e_shnum,
+                                              elf_header.e_shoff, SHT_DYNSYM,
+                                              &tables->dynsym);
+  if (tables->has_dynsym &&
+      !ReadFromOffsetExact(fd, &tables->dynstr, sizeof(tables->dynstr),
+                           elf_header.e_shoff + tables->dynsym.sh_link *
+                           sizeof(tables->dynsym))) {
+    return false;
+  }
+  return true;
+}
 
+static bool GetSymbolFromTables(const int fd, uint64_t pc,
+                                char *out, int out_size,
+                                uint64_t map_start_address,
+                                const SymbolTables &tables) {
   uint64_t symbol_offset = 0;
-  if (elf_header.e_type == ET_DYN) {  // DSO needs offset adjustment.
+  if (tables.elf_type == ET_DYN) {  // DSO needs offset adjustment.
     symbol_offset = map_start_address;
   }
 
-  ElfW(Shdr) symtab, strtab;
-
   // Consult a regular symbol table first.
-  if (GetSectionHeaderByType(fd, elf_header.e_shnum, elf_header.e_shoff,
-                             SHT_SYMTAB, &symtab)) {
-    if (!ReadFromOffsetExact(fd, &strtab, sizeof(strtab), elf_header.e_shoff +
-                             symtab.sh_link * sizeof(symtab))) {
+  if (tables.has_symtab &&
+      FindSymbol(pc, fd, out, out_size, symbol_offset,
+                 &tables.strtab, &tables.symtab)) {
+    return true;  // Found the symbol in a regular symbol table.
+  }
+
+  // If the symbol is not found, then consult a dynamic symbol table.
+  if (tables.has_dynsym &&
+      FindSymbol(pc, fd, out, out_size, symbol_offset,
+                 &tables.dynstr, &tables.dynsym)) {
+    return true;  // Found the symbol in a dynamic symbol table.
+  }
+
+  return false;
+}
+
+// Make an mmap()ed array at least "needed" bytes big, keeping its
+// contents.
+static bool GrowMapping(void **array, size_t *bytes, size_t needed) {
+  if (needed <= *bytes) {
+    return true;
+  }
+  size_t new_bytes = *bytes ? *bytes * 2 : 4096;
+  while (new_bytes < needed) {
+    new_bytes *= 2;
+  }
+  void *p = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  if (*array) {
+    memcpy(p, *array, *bytes);
+    munmap(*array, *bytes);
+  }
+  *array = p;
+  *bytes = new_bytes;
+  return true;
+}
+
+// A defined symbol of a SymbolIndex.  max_end_address is the largest
+// end address of this symbol and every symbol sorted before it, so a
+// lookup walking back from pc knows when nothing earlier can contain it.
+struct IndexedSymbol {
+  uint64_t start_address;
+  uint64_t end_address;
+  uint64_t max_end_address;
+  uint32_t name;  // Offset in the string table.
+  uint32_t order;  // Position in the symbol table.
+};
+
+// The symbols of one symbol table sorted by address, so that looking
+// up a pc is a binary search instead of FindSymbol()'s read of the
+// whole table.  Built with read() and mmap() only, but building it is
+// too slow for a crash handler: Symbolize() keeps using FindSymbol().
+struct SymbolIndex {
+  IndexedSymbol *symbols;
+  size_t num_symbols;
+  size_t bytes;
+};
+
+static bool IndexedSymbolLess(const IndexedSymbol &a, const IndexedSymbol &b) {
+  if (a.start_address != b.start_address) {
+    return a.start_address < b.start_address;
+  }
+  return a.order < b.order;
+}
+
+static void ReleaseSymbolIndex(SymbolIndex *index) {
+  if (index->symbols) {
+    munmap(index->symbols, index->bytes);
+  }
+  index->symbols = NULL;
+  index->num_symbols = 0;
+  index->bytes = 0;
+}
+
+// Read the symbols FindSymbol() would consider into "index".
+static bool BuildSymbolIndex(const int fd, const ElfW(Shdr) *symtab,
+                             SymbolIndex *index) {
+  index->symbols = NULL;
+  index->num_symbols = 0;
+  index->bytes = 0;
+  const size_t num_symbols = symtab->sh_size / symtab->sh_entsize;
+  if (num_symbols == 0) {
+    return true;
+  }
+  void *symbols = NULL;
+  if (!GrowMapping(&symbols, &index->bytes,
+                   num_symbols * sizeof(IndexedSymbol))) {
+    return false;
+  }
+  index->symbols = static_cast<IndexedSymbol *>(symbols);
+
+  for (size_t i = 0; i < num_symbols;) {
+    off_t offset = symtab->sh_offset + i * symtab->sh_entsize;
+    ElfW(Sym) buf[NUM_SYMBOLS];
+    const ssize_t len = ReadFromOffset(fd, &buf, sizeof(buf), offset);
+    if (len <= 0) {
+      break;
+    }
+    SAFE_ASSERT(len % sizeof(buf[0]) == 0);
+    const ssize_t num_symbols_in_buf = len / sizeof(buf[0]);
+    for (int j = 0; j < num_symbols_in_buf && i + j < num_symbols; ++j) {
+      const ElfW(Sym)& symbol = buf[j];
+      // Skip null value, undefined and empty symbols, none of them can
+      // contain a pc.
+      if (symbol.st_value == 0 || symbol.st_shndx == 0 ||
+          symbol.st_size == 0) {
+        continue;
+      }
+      IndexedSymbol &indexed = index->symbols[index->num_symbols++];
+      indexed.start_address = symbol.st_value;
+      indexed.end_address = symbol.st_value + symbol.st_size;
+      indexed.name = symbol.st_name;
+      indexed.order = i + j;
+    }
+    i += num_symbols_in_buf;
+  }
+
+  std::sort(index->symbols, index->symbols + index->num_symbols,
+            IndexedSymbolLess);
+  uint64_t max_end_address = 0;
+  for (size_t i = 0; i < index->num_symbols; ++i) {
+    if (index->symbols[i].end_address > max_end_address) {
+      max_end_address = index->symbols[i].end_address;
+    }
+    index->symbols[i].max_end_address = max_end_address;
+  }
+  return true;
+}
+
+// Same result as FindSymbol(): of the symbols containing pc, the one
+// that comes first in the symbol table.
+static bool FindSymbolInIndex(uint64_t pc, const int fd, char *out,
+                              int out_size, uint64_t symbol_offset,
+                              const ElfW(Shdr) *strtab,
+                              const SymbolIndex &index) {
+  const uint64_t address = pc - symbol_offset;
+  // First symbol starting after address.
+  size_t low = 0;
+  size_t high = index.num_symbols;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (index.symbols[mid].start_address <= address) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  const IndexedSymbol *found = NULL;
+  for (size_t i = low; i > 0 && index.symbols[i - 1].max_end_address > address;
+       --i) {
+    const IndexedSymbol &symbol = index.symbols[i - 1];
+    if (address < symbol.end_address &&
+        (found == NULL || symbol.order < found->order)) {
+      found = &symbol;
+    }
+  }
+  if (found == NULL) {
+    return false;
+  }
+  ssize_t len = ReadFromOffset(fd, out, out_size,
+                               strtab->sh_offset + found->name);
+  if (len <= 0 || memchr(out, '\0', out_size) == NULL) {
+    return false;
+  }
+  return true;  // Obtained the symbol name.
+}
+
+static bool GetSectionHeaderByName(const int fd, const SymbolTables &tables,
+                                   const char *name, ElfW(Shdr) *out) {
+  ElfW(Shdr) shstrtab;
+  if (tables.shstrndx == SHN_UNDEF || tables.shstrndx >= tables.shnum ||
+      !ReadFromOffsetExact(fd, &shstrtab, sizeof(shstrtab), tables.shoff +
+                           tables.shstrndx * sizeof(shstrtab))) {
+    return false;
+  }
+  const size_t name_len = strlen(name) + 1;  // With the NUL.
+  char buf[64];
+  if (name_len > sizeof(buf)) {
+    return false;
+  }
+  for (int i = 0; i < tables.shnum; ++i) {
+    ElfW(Shdr) shdr;
+    if (!ReadFromOffsetExact(fd, &shdr, sizeof(shdr),
+                             tables.shoff + i * sizeof(shdr))) {
       return false;
     }
-    if (FindSymbol(pc, fd, out, out_size, symbol_offset,
-                   &strtab, &symtab)) {
-      return true;  // Found the symbol in a regular symbol table.
+    if (ReadFromOffsetExact(fd, buf, name_len,
+                            shstrtab.sh_offset + shdr.sh_name) &&
+        memcmp(buf, name, name_len) == 0) {
+      *out = shdr;
+      return true;
     }
   }
+  return false;
+}
 
-  // If the symbol is not found, then consult a dynamic symbol table.
-  if (GetSectionHeaderByType(fd, elf_header.e_shnum, elf_header.e_shoff,
-                             SHT_DYNSYM, &symtab)) {
-    if (!ReadFromOffsetExact(fd, &strtab, sizeof(strtab), elf_header.e_shoff +
-                             symtab.sh_link * sizeof(symtab))) {
+// A section of an object file mapped read-only.
+struct MappedSection {
+  void *map;
+  size_t map_size;
+  const char *data;
+  size_t size;
+};
+
+static bool MapSection(const int fd, const SymbolTables &tables,
+                       const char *name, MappedSection *section) {
+  section->map = NULL;
+  section->data = NULL;
+  section->size = 0;
+  ElfW(Shdr) shdr;
+  // Compressed (-gz) sections would need zlib, skip them.
+  if (!GetSectionHeaderByName(fd, tables, name, &shdr) ||
+      shdr.sh_type == SHT_NOBITS || (shdr.sh_flags & SHF_COMPRESSED) ||
+      shdr.sh_size == 0) {
+    return false;
+  }
+  const off_t page = sysconf(_SC_PAGESIZE);
+  const off_t start = shdr.sh_offset & ~(page - 1);
+  const size_t delta = shdr.sh_offset - start;
+  void *map = mmap(NULL, shdr.sh_size + delta, PROT_READ, MAP_PRIVATE,
+                   fd, start);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  section->map = map;
+  section->map_size = shdr.sh_size + delta;
+  section->data = static_cast<const char *>(map) + delta;
+  section->size = shdr.sh_size;
+  return true;
+}
+
+static void UnmapSection(MappedSection *section) {
+  if (section->map) {
+    munmap(section->map, section->map_size);
+  }
+  section->map = NULL;
+}
+
+// Bounds checked little reader over a DWARF section.  Running past the
+// end clears ok() instead of reading garbage.
+class DwarfReader {
+ public:
+  DwarfReader(const char *begin, const char *end)
+      : cursor_(begin), end_(end), ok_(true) {
+  }
+
+  bool ok() const { return ok_; }
+  const char *cursor() const { return cursor_; }
+  size_t left() const { return end_ - cursor_; }
+
+  void Skip(uint64_t count) {
+    if (count > left()) {
+      Fail();
+      return;
+    }
+    cursor_ += count;
+  }
+
+  // An unsigned integer of "size" bytes in the object's byte order,
+  // which is ours.
+  uint64_t ReadFixed(int size) {
+    if ((size_t)size > left()) {
+      Fail();
+      return 0;
+    }
+    uint64_t value = 0;
+    const unsigned char *bytes =
+        reinterpret_cast<const unsigned char *>(cursor_);
+    for (int i = 0; i < size; ++i) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      value = (value << 8) | bytes[i];
+#else
+      value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+#endif
+    }
+    cursor_ += size;
+    return value;
+  }
+
+  uint64_t ReadULEB128() {
+    uint64_t value = 0;
+    int shift = 0;
+    while (cursor_ < end_) {
+      unsigned char byte = *cursor_++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    Fail();
+    return 0;
+  }
+
+  int64_t ReadSLEB128() {
+    int64_t value = 0;
+    int shift = 0;
+    while (cursor_ < end_) {
+      unsigned char byte = *cursor_++;
+      if (shift < 64) {
+        value |= static_cast<int64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+      if (!(byte & 0x80)) {
+        if (shift < 64 && (byte & 0x40)) {
+          value |= -(static_cast<int64_t>(1) << shift);
+        }
+        return value;
+      }
+    }
+    Fail();
+    return 0;
+  }
+
+  const char *ReadString() {
+    const char *begin = cursor_;
+    const char *nul =
+        static_cast<const char *>(memchr(cursor_, '\0', left()));
+    if (nul == NULL) {
+      Fail();
+      return NULL;
+    }
+    cursor_ = nul + 1;
+    return begin;
+  }
+
+ private:
+  void Fail() {
+    ok_ = false;
+    cursor_ = end_;
+  }
+
+  const char *cursor_;
+  const char *end_;
+  bool ok_;
+};
+
+// One row of a line table.  A row with line 0 ends a sequence: pcs from
+// its address on belong to the next row's sequence, if any.
+struct LineRow {
+  uint64_t address;
+  uint32_t file;  // Offset in LineIndex::names.
+  uint32_t line;
+};
+
+// The .debug_line rows of an object sorted by address, so that the
+// row of a pc is a binary search away, plus the "dir/file" names they
+// refer to.
+struct LineIndex {
+  LineRow *rows;
+  size_t num_rows;
+  size_t rows_bytes;
+  char *names;
+  size_t names_used;
+  size_t names_bytes;
+};
+
+static bool LineRowLess(const LineRow &a, const LineRow &b) {
+  if (a.address != b.address) {
+    return a.address < b.address;
+  }
+  // A sequence ending where another starts gives way to it.
+  return a.line == 0 && b.line != 0;
+}
+
+static void ReleaseLineIndex(LineIndex *index) {
+  if (index->rows) {
+    munmap(index->rows, index->rows_bytes);
+  }
+  if (index->names) {
+    munmap(index->names, index->names_bytes);
+  }
+  memset(index, 0, sizeof(*index));
+}
+
+// Store "dir/name", or just name when it is absolute or dir unknown, and
+// return its offset in index->names.
+static bool AddLineFileName(LineIndex *index, const char *dir,
+                            const char *name, uint32_t *offset) {
+  if (name == NULL) {
+    name = "??";
+  }
+  if (name[0] == '/' || dir == NULL || dir[0] == '\0') {
+    dir = NULL;
+  }
+  const size_t dir_len = dir ? strlen(dir) : 0;
+  const size_t name_len = strlen(name);
+  const size_t needed = index->names_used + dir_len + 1 + name_len + 1;
+  void *names = index->names;
+  if (needed > UINT32_MAX ||
+      !GrowMapping(&names, &index->names_bytes, needed)) {
+    return false;
+  }
+  index->names = static_cast<char *>(names);
+  *offset = index->names_used;
+  char *out = index->names + index->names_used;
+  if (dir) {
+    memcpy(out, dir, dir_len);
+    out += dir_len;
+    *out++ = '/';
+  }
+  memcpy(out, name, name_len + 1);
+  index->names_used = out + name_len + 1 - index->names;
+  return true;
+}
+
+static bool AddLineRow(LineIndex *index, uint64_t address, uint32_t file,
+                       uint32_t line) {
+  void *rows = index->rows;
+  if (!GrowMapping(&rows, &index->rows_bytes,
+                   (index->num_rows + 1) * sizeof(LineRow))) {
+    return false;
+  }
+  index->rows = static_cast<LineRow *>(rows);
+  LineRow &row = index->rows[index->num_rows++];
+  row.address = address;
+  row.file = file;
+  row.line = line;
+  return true;
+}
+
+// Strings a line table header can point into.
+struct LineStrings {
+  MappedSection debug_str;
+  MappedSection debug_line_str;
+};
+
+// DWARF constants used below, <elf.h> has none of them.
+enum {
+  kDwFormBlock = 0x09, kDwFormData1 = 0x0b, kDwFormData2 = 0x05,
+  kDwFormData4 = 0x06, kDwFormData8 = 0x07, kDwFormData16 = 0x1e,
+  kDwFormString = 0x08, kDwFormStrp = 0x0e, kDwFormUdata = 0x0f,
+  kDwFormLineStrp = 0x1f, kDwFormStrx = 0x1a, kDwFormStrx1 = 0x25,
+  kDwFormStrx2 = 0x26, kDwFormStrx3 = 0x27, kDwFormStrx4 = 0x28,
+  kDwLnctPath = 0x1, kDwLnctDirectoryIndex = 0x2,
+  kDwLnsCopy = 1, kDwLnsAdvancePc = 2, kDwLnsAdvanceLine = 3,
+  kDwLnsSetFile = 4, kDwLnsConstAddPc = 8, kDwLnsFixedAdvancePc = 9,
+  kDwLneEndSequence = 1, kDwLneSetAddress = 2
+};
+
+static const char *SectionString(const MappedSection &section,
+                                 uint64_t offset) {
+  if (section.data == NULL || offset >= section.size ||
+      memchr(section.data + offset, '\0', section.size - offset) == NULL) {
+    return NULL;
+  }
+  return section.data + offset;
+}
+
+// Read one attribute of a DWARF 5 directory or file entry.  Strings
+// come back in *string, numbers in *value.  False for forms a line
+// table header should not use.
+static bool ReadLineHeaderForm(DwarfReader *reader, uint64_t form,
+                               int offset_size, const LineStrings &strings,
+                               const char **string, uint64_t *value) {
+  *string = NULL;
+  *value = 0;
+  switch (form) {
+    case kDwFormString:
+      *string = reader->ReadString();
+      break;
+    case kDwFormLineStrp:
+      *string = SectionString(strings.debug_line_str,
+                              reader->ReadFixed(offset_size));
+      break;
+    case kDwFormStrp:
+      *string = SectionString(strings.debug_str,
+                              reader->ReadFixed(offset_size));
+      break;
+    // Needs .debug_str_offsets and the unit's base, leave the name out.
+    case kDwFormStrx: reader->ReadULEB128(); break;
+    case kDwFormStrx1: reader->Skip(1); break;
+    case kDwFormStrx2: reader->Skip(2); break;
+    case kDwFormStrx3: reader->Skip(3); break;
+    case kDwFormStrx4: reader->Skip(4); break;
+    case kDwFormUdata: *value = reader->ReadULEB128(); break;
+    case kDwFormData1: *value = reader->ReadFixed(1); break;
+    case kDwFormData2: *value = reader->ReadFixed(2); break;
+    case kDwFormData4: *value = reader->ReadFixed(4); break;
+    case kDwFormData8: *value = reader->ReadFixed(8); break;
+    case kDwFormData16: reader->Skip(16); break;
+    case kDwFormBlock: reader->Skip(reader->ReadULEB128()); break;
+    default:
       return false;
+  }
+  return reader->ok();
+}
+
+// Scratch space reused by every unit of a line table: the unit's
+// directories and its files' offsets in LineIndex::names.
+struct LineUnitTables {
+  const char **dirs;
+  size_t num_dirs;
+  size_t dirs_bytes;
+  uint32_t *files;
+  size_t num_files;
+  size_t files_bytes;
+};
+
+static bool AddLineDir(LineUnitTables *unit, const char *dir) {
+  void *dirs = unit->dirs;
+  if (!GrowMapping(&dirs, &unit->dirs_bytes,
+                   (unit->num_dirs + 1) * sizeof(const char *))) {
+    return false;
+  }
+  unit->dirs = static_cast<const char **>(dirs);
+  unit->dirs[unit->num_dirs++] = dir;
+  return true;
+}
+
+static bool AddLineFile(LineUnitTables *unit, LineIndex *index,
+                        const char *name, uint64_t dir) {
+  uint32_t offset;
+  void *files = unit->files;
+  if (!AddLineFileName(index, dir < unit->num_dirs ? unit->dirs[dir] : NULL,
+                       name, &offset) ||
+      !GrowMapping(&files, &unit->files_bytes,
+                   (unit->num_files + 1) * sizeof(uint32_t))) {
+    return false;
+  }
+  unit->files = static_cast<uint32_t *>(files);
+  unit->files[unit->num_files++] = offset;
+  return true;
+}
+
+// Read the directory and file tables of a DWARF 5 line table header.
+static bool ReadLineEntries(DwarfReader *reader, int offset_size,
+                            const LineStrings &strings, bool files,
+                            LineUnitTables *unit, LineIndex *index) {
+  uint64_t formats[2 * 16];
+  const int num_formats = reader->ReadFixed(1);
+  if (num_formats > 16) {
+    return false;
+  }
+  for (int i = 0; i < 2 * num_formats; ++i) {
+    formats[i] = reader->ReadULEB128();
+  }
+  const uint64_t count = reader->ReadULEB128();
+  for (uint64_t n = 0; n < count && reader->ok(); ++n) {
+    const char *path = NULL;
+    uint64_t dir = 0;
+    for (int i = 0; i < num_formats; ++i) {
+      const char *string;
+      uint64_t value;
+      if (!ReadLineHeaderForm(reader, formats[2 * i + 1], offset_size,
+                              strings, &string, &value)) {
+        return false;
+      }
+      if (formats[2 * i] == kDwLnctPath) {
+        path = string;
+      } else if (formats[2 * i] == kDwLnctDirectoryIndex) {
+        dir = value;
+      }
     }
-    if (FindSymbol(pc, fd, out, out_size, symbol_offset,
-                   &strtab, &symtab)) {
-      return true;  // Found the symbol in a dynamic symbol table.
+    if (files ? !AddLineFile(unit, index, path, dir)
+              : !AddLineDir(unit, path)) {
+      return false;
     }
   }
+  return reader->ok();
+}
 
-  return false;
+// Run the line program of one unit, appending its rows.  Sequences
+// starting at address 0 or -1 belong to code the linker discarded and
+// are dropped, so is a sequence cut short by malformed input.  Returns
+// false only when running out of memory.
+static bool RunLineProgram(DwarfReader *reader, const LineUnitTables &unit,
+                           int address_size, int min_inst_length,
+                           int line_base, int line_range, int opcode_base,
+                           const unsigned char *opcode_lengths,
+                           LineIndex *index) {
+  uint64_t address = 0;
+  uint64_t file = 1;
+  int64_t line = 1;
+  size_t sequence_start = index->num_rows;
+  uint64_t sequence_address = 0;
+  bool sequence_started = false;
+  while (reader->left() > 0 && reader->ok()) {
+    const int opcode = reader->ReadFixed(1);
+    bool emit = false;
+    bool end_sequence = false;
+    if (opcode >= opcode_base) {
+      const int adjusted = opcode - opcode_base;
+      address += (adjusted / line_range) * min_inst_length;
+      line += line_base + adjusted % line_range;
+      emit = true;
+    } else if (opcode == 0) {
+      const uint64_t length = reader->ReadULEB128();
+      const char *next = reader->cursor();
+      if (length == 0 || length > reader->left()) {
+        break;
+      }
+      const int sub_opcode = reader->ReadFixed(1);
+      if (sub_opcode == kDwLneEndSequence) {
+        emit = true;
+        end_sequence = true;
+      } else if (sub_opcode == kDwLneSetAddress) {
+        address = reader->ReadFixed(length - 1 < 8 ? length - 1 : 8);
+      }
+      reader->Skip(next + length - reader->cursor());
+    } else if (opcode == kDwLnsCopy) {
+      emit = true;
+    } else if (opcode == kDwLnsAdvancePc) {
+      address += reader->ReadULEB128() * min_inst_length;
+    } else if (opcode == kDwLnsAdvanceLine) {
+      line += reader->ReadSLEB128();
+    } else if (opcode == kDwLnsSetFile) {
+      file = reader->ReadULEB128();
+    } else if (opcode == kDwLnsConstAddPc) {
+      address += ((255 - opcode_base) / line_range) * min_inst_length;
+    } else if (opcode == kDwLnsFixedAdvancePc) {
+      address += reader->ReadFixed(2);
+    } else {
+      // Standard opcodes without effect on address, file or line, and
+      // opcodes newer than us: skip their operands.
+      for (int i = 0; i < opcode_lengths[opcode - 1]; ++i) {
+        reader->ReadULEB128();
+      }
+    }
+    if (!emit) {
+      continue;
+    }
+    if (!sequence_started) {
+      sequence_started = true;
+      sequence_address = address;
+      sequence_start = index->num_rows;
+    }
+    const uint32_t name = file < unit.num_files ? unit.files[file] : 0;
+    const uint32_t row_line =
+        end_sequence ? 0 : (line > 0 && line < UINT32_MAX ? line : 1);
+    if (!AddLineRow(index, address, name, row_line)) {
+      index->num_rows = sequence_start;
+      return false;
+    }
+    if (end_sequence) {
+      if (sequence_address == 0 || sequence_address == ~(uint64_t)0 ||
+          (address_size == 4 && sequence_address == 0xffffffff)) {
+        index->num_rows = sequence_start;
+      }
+      address = 0;
+      file = 1;
+      line = 1;
+      sequence_started = false;
+    }
+  }
+  // A sequence without its end is not trusted.
+  if (sequence_started) {
+    index->num_rows = sequence_start;
+  }
+  return true;
+}
+
+// Parse every unit of .debug_line into "index".
+static bool BuildLineIndex(const int fd, const SymbolTables &tables,
+                           LineIndex *index) {
+  memset(index, 0, sizeof(*index));
+  MappedSection debug_line;
+  if (!MapSection(fd, tables, ".debug_line", &debug_line)) {
+    return false;
+  }
+  LineStrings strings;
+  MapSection(fd, tables, ".debug_str", &strings.debug_str);
+  MapSection(fd, tables, ".debug_line_str", &strings.debug_line_str);
+  LineUnitTables unit;
+  memset(&unit, 0, sizeof(unit));
+  // Offset 0 of the names is the "??" of rows whose file is unknown.
+  uint32_t unknown;
+  bool ok = AddLineFileName(index, NULL, "??", &unknown);
+
+  DwarfReader units(debug_line.data, debug_line.data + debug_line.size);
+  while (ok && units.left() > 0) {
+    int offset_size = 4;
+    uint64_t unit_length = units.ReadFixed(4);
+    if (unit_length == 0xffffffff) {
+      offset_size = 8;
+      unit_length = units.ReadFixed(8);
+    }
+    if (!units.ok() || unit_length > units.left()) {
+      break;
+    }
+    const char *unit_end = units.cursor() + unit_length;
+    DwarfReader reader(units.cursor(), unit_end);
+    units.Skip(unit_length);
+
+    const int version = reader.ReadFixed(2);
+    if (version < 2 || version > 5) {
+      continue;
+    }
+    int address_size = sizeof(void *);
+    if (version >= 5) {
+      address_size = reader.ReadFixed(1);
+      reader.ReadFixed(1);  // segment_selector_size
+    }
+    const uint64_t header_length = reader.ReadFixed(offset_size);
+    if (!reader.ok() || header_length > reader.left()) {
+      continue;
+    }
+    const char *program = reader.cursor() + header_length;
+    const int min_inst_length = reader.ReadFixed(1);
+    if (version >= 4) {
+      reader.ReadFixed(1);  // maximum_operations_per_instruction
+    }
+    reader.ReadFixed(1);  // default_is_stmt
+    const int line_base = static_cast<signed char>(reader.ReadFixed(1));
+    const int line_range = reader.ReadFixed(1);
+    const int opcode_base = reader.ReadFixed(1);
+    const unsigned char *opcode_lengths =
+        reinterpret_cast<const unsigned char *>(reader.cursor());
+    reader.Skip(opcode_base > 0 ? opcode_base - 1 : 0);
+    if (!reader.ok() || line_range == 0 || opcode_base == 0) {
+      continue;
+    }
+
+    unit.num_dirs = 0;
+    unit.num_files = 0;
+    if (version >= 5) {
+      if (!ReadLineEntries(&reader, offset_size, strings, false, &unit,
+                           index) ||
+          !ReadLineEntries(&reader, offset_size, strings, true, &unit,
+                           index)) {
+        continue;
+      }
+    } else {
+      // Directory 0 and file 0 are the unit's own, which only
+      // .debug_info knows.
+      ok = AddLineDir(&unit, NULL) && AddLineFile(&unit, index, NULL, 0);
+      const char *dir;
+      while (ok && (dir = reader.ReadString()) != NULL && dir[0] != '\0') {
+        ok = AddLineDir(&unit, dir);
+      }
+      const char *name;
+      while (ok && (name = reader.ReadString()) != NULL && name[0] != '\0') {
+        const uint64_t dir_index = reader.ReadULEB128();
+        reader.ReadULEB128();  // mtime
+        reader.ReadULEB128();  // length
+        ok = AddLineFile(&unit, index, name, dir_index);
+      }
+      if (!ok || !reader.ok()) {
+        continue;
+      }
+    }
+
+    DwarfReader program_reader(program, unit_end);
+    ok = RunLineProgram(&program_reader, unit, address_size, min_inst_length,
+                        line_base, line_range, opcode_base, opcode_lengths,
+                        index);
+  }
+
+  if (unit.dirs) {
+    munmap(unit.dirs, unit.dirs_bytes);
+  }
+  if (unit.files) {
+    munmap(unit.files, unit.files_bytes);
+  }
+  UnmapSection(&strings.debug_line_str);
+  UnmapSection(&strings.debug_str);
+  UnmapSection(&debug_line);
+  if (!ok) {
+    ReleaseLineIndex(index);
+    return false;
+  }
+  std::sort(index->rows, index->rows + index->num_rows, LineRowLess);
+  return true;
 }
 
+// The row holding address, false when it falls outside every sequence.
+static bool FindLineRow(const LineIndex &index, uint64_t address,
+                        const LineRow **row) {
+  size_t low = 0;
+  size_t high = index.num_rows;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (index.rows[mid].address <= address) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == 0 || index.rows[low - 1].line == 0) {
+    return false;
+  }
+  *row = &index.rows[low - 1];
+  return true;
+}
+
+static bool GetSymbolFromObjectFile(const int fd, uint64_t pc,
+                                    char *out, int out_size,
+                                    uint64_t map_start_address) {
+  SymbolTables tables;
+  if (!ReadSymbolTables(fd, &tables)) {
+    return false;
+  }
+  return GetSymbolFromTables(fd, pc, out, out_size, map_start_address,
+                             tables);
+}
+
+// Async signal safe: bounded, on the stack, for Symbolize().
 static void DemangleInplace(char *out, int out_size) {
   char demangled[256];  // Big enough for sane demangled symbols.
   if (Demangle(out, demangled, sizeof(demangled))) {
@@ -579,6 +1435,19 @@ static void DemangleInplace(char *out, int out_size) {
   }
 }
 
+// Memoized and without a length limit, for SymbolizeSession, which is
+// not async signal safe anyway.
+static void DemangleInplaceCached(char *out, int out_size) {
+  const char *demangled = DemangleCached(out);
+  if (demangled != NULL) {
+    // Demangling succeeded. Copy to out if the space allows.
+    size_t len = strlen(demangled);
+    if (len + 1 <= (size_t)out_size) {  // +1 for '\0'.
+      memcpy(out, demangled, len + 1);
+    }
+  }
+}
+
 static bool SymbolizeAndDemangle(void *pc, char *out,
                                  int out_size) {
   uint64_t pc0 = reinterpret_cast<uintptr_t>(pc);
@@ -635,4 +1504,363 @@ bool Symbolize(void *pc, char *out, int out_size) {
     return SymbolizeAndDemangle(pc, out, out_size);
 }
 
+// One executable mapping from /proc/self/maps.
+struct SymbolizeSession::Range {
+  uint64_t start_address;
+  uint64_t end_address;
+  // Where offset 0 of the object would be mapped.
+  uint64_t load_address;
+  // What Symbolize() prints as "(file+0xoffset)" when the object
+  // cannot be read, see OpenObjectFileContainingPcAndGetStartAddress().
+  uint64_t base_address;
+  int object;
+};
+
+// An object file with at least one executable mapping.
+struct SymbolizeSession::Object {
+  char name[1024];
+  // -1 until first needed, -2 when it cannot be opened, -3 when it is
+  // not an ELF file we can read.
+  int fd;
+  SymbolTables tables;
+  // Empty when the object has no such table or indexing it failed, in
+  // which case lookups fall back to FindSymbol().
+  bool indexed;
+  SymbolIndex symtab_index;
+  SymbolIndex dynsym_index;
+  // Built by the first SymbolizeLine() for the object.
+  bool lines_loaded;
+  LineIndex lines;
+};
+
+// dl_iterate_phdr() callback, the counters are the same for every object.
+static int ReadLoadCounters(struct dl_phdr_info *info, size_t size,
+                            void *data) {
+  unsigned long long *counters = static_cast<unsigned long long *>(data);
+  if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+              sizeof(info->dlpi_subs)) {
+    counters[0] = info->dlpi_adds;
+    counters[1] = info->dlpi_subs;
+  }
+  return 1;
+}
+
+SymbolizeSession::SymbolizeSession()
+    : ranges_(NULL), num_ranges_(0), ranges_bytes_(0),
+      objects_(NULL), num_objects_(0), objects_bytes_(0),
+      adds_(0), subs_(0), loaded_(false), offline_(false) {
+  root_[0] = '\0';
+}
+
+SymbolizeSession::~SymbolizeSession() {
+  Reset();
+  if (ranges_) {
+    munmap(ranges_, ranges_bytes_);
+  }
+  if (objects_) {
+    munmap(objects_, objects_bytes_);
+  }
+}
+
+void SymbolizeSession::Reset() {
+  for (int i = 0; i < num_objects_; ++i) {
+    if (objects_[i].fd >= 0) {
+      NO_INTR(close(objects_[i].fd));
+    }
+    ReleaseSymbolIndex(&objects_[i].symtab_index);
+    ReleaseSymbolIndex(&objects_[i].dynsym_index);
+    ReleaseLineIndex(&objects_[i].lines);
+  }
+  num_ranges_ = 0;
+  num_objects_ = 0;
+  loaded_ = false;
+}
+
+bool SymbolizeSession::LoadMaps(const char *maps_path, const char *root) {
+  Reset();
+  offline_ = true;
+  root_[0] = '\0';
+  if (root != NULL) {
+    SafeAppendString(root, root_, sizeof(root_));
+  }
+  loaded_ = Load(maps_path);
+  return loaded_;
+}
+
+bool SymbolizeSession::Refresh() {
+  if (offline_) {
+    return loaded_;
+  }
+  unsigned long long counters[2] = { 0, 0 };
+  dl_iterate_phdr(ReadLoadCounters, counters);
+  if (loaded_ && counters[0] == adds_ && counters[1] == subs_) {
+    return true;
+  }
+  Reset();
+  adds_ = counters[0];
+  subs_ = counters[1];
+  loaded_ = Load("/proc/self/maps");
+  return loaded_;
+}
+
+// Open an object by the name /proc/<pid>/maps gave it, trying root_
+// first for sessions created by LoadMaps().
+int SymbolizeSession::OpenObject(const char *name) {
+  int fd;
+  if (root_[0] != '\0') {
+    char path[sizeof(root_) + sizeof(objects_->name)];
+    path[0] = '\0';
+    SafeAppendString(root_, path, sizeof(path));
+    SafeAppendString(name, path, sizeof(path));
+    NO_INTR(fd = open(path, O_RDONLY));
+    if (fd >= 0) {
+      return fd;
+    }
+    const char *base = strrchr(name, '/');
+    path[0] = '\0';
+    SafeAppendString(root_, path, sizeof(path));
+    SafeAppendString("/", path, sizeof(path));
+    SafeAppendString(base ? base + 1 : name, path, sizeof(path));
+    NO_INTR(fd = open(path, O_RDONLY));
+    if (fd >= 0) {
+      return fd;
+    }
+  }
+  NO_INTR(fd = open(name, O_RDONLY));
+  return fd;
+}
+
+int SymbolizeSession::AddObject(const char *name) {
+  // Mappings of one object are adjacent, look at the last one first.
+  for (int i = num_objects_ - 1; i >= 0; --i) {
+    if (strcmp(objects_[i].name, name) == 0) {
+      return i;
+    }
+  }
+  void *objects = objects_;
+  if (!GrowMapping(&objects, &objects_bytes_,
+                   (num_objects_ + 1) * sizeof(Object))) {
+    return -1;
+  }
+  objects_ = static_cast<Object *>(objects);
+  Object &object = objects_[num_objects_];
+  strncpy(object.name, name, sizeof(object.name));
+  // Making sure |name| is always null-terminated.
+  object.name[sizeof(object.name) - 1] = '\0';
+  object.fd = -1;
+  object.indexed = false;
+  object.symtab_index.symbols = NULL;
+  object.dynsym_index.symbols = NULL;
+  object.lines_loaded = false;
+  memset(&object.lines, 0, sizeof(object.lines));
+  return num_objects_++;
+}
+
+// Read every "r-x" mapping of a maps file into ranges_.
+bool SymbolizeSession::Load(const char *maps_path) {
+  int maps_fd;
+  NO_INTR(maps_fd = open(maps_path, O_RDONLY));
+  FileDescriptor wrapped_maps_fd(maps_fd);
+  if (wrapped_maps_fd.get() < 0) {
+    return false;
+  }
+
+  char buf[1024];  // Big enough for line of sane /proc/self/maps
+  int num_maps = 0;
+  bool sorted = true;
+  LineReader reader(wrapped_maps_fd.get(), buf, sizeof(buf));
+  const char *cursor;
+  const char *eol;
+  while (reader.ReadLine(&cursor, &eol)) {
+    num_maps++;
+    uint64_t start_address;
+    uint64_t end_address;
+    const char *flags;
+    uint64_t file_offset;
+    const char *name;
+    if (!ParseMapsLine(cursor, eol, &start_address, &end_address,
+                       &flags, &file_offset, &name)) {
+      return false;  // Malformed line.
+    }
+    // Anonymous code (JIT) has no symbols to look up.
+    if (memcmp(flags, "r-x", 3) != 0 || name == eol) {
+      continue;
+    }
+    int object = AddObject(name);
+    void *ranges = ranges_;
+    if (object < 0 ||
+        !GrowMapping(&ranges, &ranges_bytes_,
+                     (num_ranges_ + 1) * sizeof(Range))) {
+      return false;
+    }
+    ranges_ = static_cast<Range *>(ranges);
+    Range &range = ranges_[num_ranges_];
+    range.start_address = start_address;
+    range.end_address = end_address;
+    range.load_address = start_address - file_offset;
+    range.base_address = ((num_maps == 1) ? 0U : start_address) - file_offset;
+    range.object = object;
+    if (num_ranges_ && ranges_[num_ranges_ - 1].start_address > start_address) {
+      sorted = false;
+    }
+    num_ranges_++;
+  }
+
+  // The kernel lists mappings by address, this is only a safety net.
+  if (!sorted) {
+    for (int i = 1; i < num_ranges_; ++i) {
+      Range range = ranges_[i];
+      int j = i;
+      for (; j > 0 && ranges_[j - 1].start_address > range.start_address;
+           --j) {
+        ranges_[j] = ranges_[j - 1];
+      }
+      ranges_[j] = range;
+    }
+  }
+  return true;
+}
+
+// Open an object and index its symbols the first time it is needed.
+SymbolizeSession::Object &SymbolizeSession::LoadObject(int index) {
+  Object &object = objects_[index];
+  if (object.fd != -1) {
+    return object;
+  }
+  int fd = OpenObject(object.name);
+  object.fd = fd < 0 ? -2 : fd;
+  if (object.fd >= 0 && !ReadSymbolTables(object.fd, &object.tables)) {
+    NO_INTR(close(object.fd));
+    object.fd = -3;
+  }
+  if (object.fd >= 0) {
+    object.indexed =
+        (!object.tables.has_symtab ||
+         BuildSymbolIndex(object.fd, &object.tables.symtab,
+                          &object.symtab_index)) &&
+        (!object.tables.has_dynsym ||
+         BuildSymbolIndex(object.fd, &object.tables.dynsym,
+                          &object.dynsym_index));
+    if (!object.indexed) {
+      ReleaseSymbolIndex(&object.symtab_index);
+      ReleaseSymbolIndex(&object.dynsym_index);
+    }
+  }
+  return object;
+}
+
+const SymbolizeSession::Range *SymbolizeSession::FindRange(uint64_t pc) const {
+  // Last range starting at or before pc.
+  int low = 0;
+  int high = num_ranges_;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (ranges_[mid].start_address <= pc) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == 0 || pc >= ranges_[low - 1].end_address) {
+    return NULL;
+  }
+  return &ranges_[low - 1];
+}
+
+bool SymbolizeSession::Symbolize(void *pc, char *out, int out_size) {
+  SAFE_ASSERT(out_size >= 0);
+  uint64_t pc0 = reinterpret_cast<uintptr_t>(pc);
+
+  if (out_size < 1) {
+    return false;
+  }
+  out[0] = '\0';
+  if (!Refresh()) {
+    return false;
+  }
+  const Range *range = FindRange(pc0);
+  if (range == NULL) {
+    return false;
+  }
+
+  Object &object = LoadObject(range->object);
+
+  // Symbolize() gives up on objects that are not ELF, so do we.
+  if (object.fd == -3) {
+    return false;
+  }
+  if (object.fd == -2) {
+    // Same as Symbolize(): the object file and offset are still useful
+    // to tools like asan_symbolize.py.
+    SafeAppendString("(", out, out_size);
+    SafeAppendString(object.name, out, out_size);
+    SafeAppendString("+0x", out, out_size);
+    SafeAppendHexNumber(pc0 - range->base_address, out, out_size);
+    SafeAppendString(")", out, out_size);
+    return true;
+  }
+
+  if (object.indexed) {
+    uint64_t symbol_offset = 0;
+    if (object.tables.elf_type == ET_DYN) {  // DSO needs offset adjustment.
+      symbol_offset = range->load_address;
+    }
+    // Regular symbol table first, then the dynamic one.
+    if (!FindSymbolInIndex(pc0, object.fd, out, out_size, symbol_offset,
+                           &object.tables.strtab, object.symtab_index) &&
+        !FindSymbolInIndex(pc0, object.fd, out, out_size, symbol_offset,
+                           &object.tables.dynstr, object.dynsym_index)) {
+      return false;
+    }
+  } else if (!GetSymbolFromTables(object.fd, pc0, out, out_size,
+                                  range->load_address, object.tables)) {
+    return false;
+  }
+
+  // Symbolization succeeded.  Now we try to demangle the symbol.
+  DemangleInplaceCached(out, out_size);
+  return true;
+}
+
+
+bool SymbolizeSession::SymbolizeLine(void *pc, char *file, int file_size,
+                                     int *line) {
+  SAFE_ASSERT(file_size >= 0);
+  uint64_t pc0 = reinterpret_cast<uintptr_t>(pc);
+
+  if (file_size < 1) {
+    return false;
+  }
+  file[0] = '\0';
+  if (!Refresh()) {
+    return false;
+  }
+  const Range *range = FindRange(pc0);
+  if (range == NULL) {
+    return false;
+  }
+  Object &object = LoadObject(range->object);
+  if (object.fd < 0) {
+    return false;
+  }
+  if (!object.lines_loaded) {
+    object.lines_loaded = true;
+    if (!BuildLineIndex(object.fd, object.tables, &object.lines)) {
+      memset(&object.lines, 0, sizeof(object.lines));
+    }
+  }
+
+  uint64_t address = pc0;
+  if (object.tables.elf_type == ET_DYN) {  // DSO needs offset adjustment.
+    address -= range->load_address;
+  }
+  const LineRow *row;
+  if (!FindLineRow(object.lines, address, &row)) {
+    return false;
+  }
+  SafeAppendString(object.lines.names + row->file, file, file_size);
+  *line = row->line;
+  return true;
+}
+
 }
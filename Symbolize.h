@@ -54,10 +54,74 @@
 #ifndef SYMBOLIZE_H
 #define SYMBOLIZE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 namespace WTF {
 
 bool Symbolize(void *pc, char *out, int out_size);
 
+// Symbolize() looks everything up again for each pc: it rereads
+// /proc/self/maps, reopens the object file and rereads its section
+// headers.  A session keeps all of that between calls: the executable
+// mappings are parsed once into a table sorted by address, and every
+// object keeps an open fd and its symbol table headers.  The snapshot
+// is rebuilt only after dlopen() or dlclose() changed the loaded
+// objects, as reported by the adds/subs counters of dl_iterate_phdr().
+//
+// Memory comes from mmap(), so a session does not call malloc() either.
+// Not thread safe.
+class SymbolizeSession {
+ public:
+  SymbolizeSession();
+  ~SymbolizeSession();
+
+  // Same output as Symbolize(), except that names are demangled with
+  // DemangleCached(), without Symbolize()'s 256 byte limit.
+  bool Symbolize(void *pc, char *out, int out_size);
+
+  // Source file and line of pc, as recorded in the .debug_line of its
+  // object: the first call for an object indexes its line table by
+  // address.  Inlined frames are not expanded, the line is the one of
+  // the outermost function.
+  bool SymbolizeLine(void *pc, char *file, int file_size, int *line);
+
+  // Symbolize pcs of another process from then on, using a copy of its
+  // /proc/<pid>/maps.  When root is not NULL, object files are looked
+  // for under root first, with their full path and then by base name.
+  bool LoadMaps(const char *maps_path, const char *root);
+
+  // Drop the snapshot and close every object fd.
+  void Reset();
+
+ private:
+  struct Range;
+  struct Object;
+
+  SymbolizeSession(const SymbolizeSession&);
+  void operator=(const SymbolizeSession&);
+
+  bool Refresh();
+  bool Load(const char *maps_path);
+  int AddObject(const char *name);
+  int OpenObject(const char *name);
+  Object &LoadObject(int index);
+  const Range *FindRange(uint64_t pc) const;
+
+  Range *ranges_;
+  int num_ranges_;
+  size_t ranges_bytes_;
+  Object *objects_;
+  int num_objects_;
+  size_t objects_bytes_;
+  unsigned long long adds_;
+  unsigned long long subs_;
+  bool loaded_;
+  // Set by LoadMaps(), the snapshot is then never refreshed.
+  bool offline_;
+  char root_[1024];
+};
+
 }
 
 #endif // SYMBOLIZE_H
@@ -0,0 +1,253 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SimpleMallocTrace.h"
+
+// Measures what the tracker adds to each malloc function, as ns per
+// operation and per thread at several sizes and 1..N threads, in three
+// configurations: plain libc (smtbench itself), tracker built in
+// (smtbenchtraced) and tracker preloaded (smtbench with
+// libsimplemalloctrace.so in LD_PRELOAD).  The tracked configurations
+// are run again for each entry of options and with nested scopes open.
+// Every run is a child process started from a scratch directory that
+// takes the leak reports.  Output is CSV on stdout.
+//
+// usage: smtbench [iterations per thread] [max threads]
+
+// resolved only where the tracker is built in or preloaded
+#pragma weak smtstart
+#pragma weak smtstop
+
+#define LIVE 64
+#define MAXTHREADS 64
+#define MAXSCOPES 64
+
+static const size_t sizes[] = { 16, 256, 4096, 65536 };
+
+static const struct {
+    const char* name;
+    const char* env;
+} options[] = {
+    { "default", 0 },
+    { "depth=4", "SMT_DEPTH=4" },
+    { "depth=16", "SMT_DEPTH=16" },
+    { "depth=32", "SMT_DEPTH=32" },
+    { "unwinder=fp", "SMT_UNWINDER=fp" },
+    { "async", "SMT_ASYNC=1" },
+    { "nolocalcache", "SMT_LOCAL_CACHE=0" },
+    { "sample=65536", "SMT_SAMPLE_INTERVAL=65536" },
+};
+
+// scopes left open by smtstart() while measuring, default options only
+static const int scopes[] = { 1, 16 };
+
+enum Operation {
+    MALLOC,
+    CALLOC,
+    REALLOC,
+    MEMALIGN,
+    OPERATIONS
+};
+
+static const char* operations[OPERATIONS] = { "malloc", "calloc", "realloc", "memalign" };
+
+static Operation operation;
+static size_t size;
+static long iterations = 20000;
+static pthread_barrier_t barrier;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Each thread keeps LIVE blocks and replaces one per iteration, freeing
+// the oldest, so that frees do not always hit the block just allocated.
+// realloc grows every block from 8 bytes to size in doubling steps and
+// counts each step.  Each thread times itself into *arg.
+static void* worker(void* arg)
+{
+    void* live[LIVE];
+    memset(live, 0, sizeof(live));
+    pthread_barrier_wait(&barrier);
+    double before = now();
+    for (long i = 0; i < iterations; i++) {
+        void** slot = &live[i % LIVE];
+        free(*slot);
+        switch (operation) {
+        case MALLOC:
+            *slot = malloc(size);
+            break;
+        case CALLOC:
+            *slot = calloc(1, size);
+            break;
+        case REALLOC:
+            *slot = malloc(8);
+            for (size_t sz = 16; sz <= size; sz *= 2) {
+                *slot = realloc(*slot, sz);
+                i++;
+            }
+            break;
+        case MEMALIGN:
+            *slot = memalign(64, size);
+            break;
+        default:
+            break;
+        }
+    }
+    *static_cast<double*>(arg) = now() - before;
+    for (int i = 0; i < LIVE; i++)
+        free(live[i]);
+    return 0;
+}
+
+// ns per operation per thread, from the time threads took on average
+// for iterations operations each
+static double measure(int threads)
+{
+    pthread_t ids[MAXTHREADS];
+    double elapsed[MAXTHREADS];
+    double total = 0;
+    pthread_barrier_init(&barrier, 0, threads);
+    for (int t = 0; t < threads; t++)
+        pthread_create(&ids[t], 0, worker, &elapsed[t]);
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ids[t], 0);
+        total += elapsed[t];
+    }
+    pthread_barrier_destroy(&barrier);
+    return total / threads / iterations;
+}
+
+// one configuration: every operation, size and thread count
+static void bench(const char* config, const char* option, int nscopes, int maxthreads)
+{
+    size_t opened[MAXSCOPES];
+    if (nscopes > MAXSCOPES)
+        nscopes = MAXSCOPES;
+    for (int s = 0; s < nscopes && smtstart; s++)
+        opened[s] = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    for (int op = 0; op < OPERATIONS; op++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (int threads = 1; threads <= maxthreads; threads *= 2) {
+                operation = static_cast<Operation>(op);
+                size = sizes[s];
+                double ns = measure(threads);
+                printf("%s,%s,%d,%s,%lu,%d,%.1f,%.2f\n", config, option, nscopes, operations[op], size, threads,
+                    ns, threads * 1e3 / ns);
+                fflush(stdout);
+            }
+        }
+    }
+    for (int s = nscopes - 1; s >= 0 && smtstop; s--)
+        smtstop(opened[s], __FILE__, __FUNCTION__, __LINE__);
+}
+
+// run argv[0] of the given binary as a worker in dir, with env added
+static int run(const char* dir, const char* binary, const char* preload, const char* env,
+    const char* config, const char* option, int nscopes, int maxthreads)
+{
+    char iterationsarg[32], scopesarg[32], threadsarg[32];
+    snprintf(iterationsarg, sizeof(iterationsarg), "%ld", iterations);
+    snprintf(scopesarg, sizeof(scopesarg), "%d", nscopes);
+    snprintf(threadsarg, sizeof(threadsarg), "%d", maxthreads);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (!pid) {
+        // the tracker talks on stderr
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, 2);
+        if (chdir(dir))
+            _exit(1);
+        if (preload)
+            setenv("LD_PRELOAD", preload, 1);
+        if (env)
+            putenv(const_cast<char*>(env));
+        execl(binary, binary, "--worker", config, option, scopesarg, iterationsarg, threadsarg, (char*)0);
+        _exit(1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "%s %s%s%s failed\n", config, binary, env ? " with " : "", env ? env : "");
+        return -1;
+    }
+    return 0;
+}
+
+static void cleanup(const char* dir)
+{
+    DIR* d = opendir(dir);
+    if (!d)
+        return;
+    while (struct dirent* entry = readdir(d)) {
+        char path[PATH_MAX];
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+int main(int argc, char* argv[])
+{
+    int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc == 7 && !strcmp(argv[1], "--worker")) {
+        iterations = atol(argv[5]);
+        bench(argv[2], argv[3], atoi(argv[4]), atoi(argv[6]));
+        return 0;
+    }
+    if (argc > 1 && atol(argv[1]) > 0)
+        iterations = atol(argv[1]);
+    if (argc > 2 && atoi(argv[2]) > 0)
+        maxthreads = atoi(argv[2]);
+    if (maxthreads > MAXTHREADS)
+        maxthreads = MAXTHREADS;
+
+    // smtbenchtraced and libsimplemalloctrace.so are built next to us
+    char self[PATH_MAX], traced[PATH_MAX], preload[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n <= 0) {
+        perror("readlink");
+        return 1;
+    }
+    self[n] = 0;
+    char* slash = strrchr(self, '/');
+    snprintf(traced, sizeof(traced), "%.*s/smtbenchtraced", (int)(slash - self), self);
+    snprintf(preload, sizeof(preload), "%.*s/libsimplemalloctrace.so", (int)(slash - self), self);
+    char dir[] = "/tmp/smtbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    int failed = 0;
+    printf("config,options,scopes,operation,size,threads,ns_per_op,mops_per_s\n");
+    failed |= run(dir, self, 0, 0, "libc", "none", 0, maxthreads);
+    for (size_t o = 0; o < sizeof(options) / sizeof(options[0]); o++) {
+        failed |= run(dir, traced, 0, options[o].env, "builtin", options[o].name, 0, maxthreads);
+        failed |= run(dir, self, preload, options[o].env, "preload", options[o].name, 0, maxthreads);
+    }
+    for (size_t s = 0; s < sizeof(scopes) / sizeof(scopes[0]); s++) {
+        failed |= run(dir, traced, 0, 0, "builtin", "default", scopes[s], maxthreads);
+        failed |= run(dir, self, preload, 0, "preload", "default", scopes[s], maxthreads);
+    }
+    cleanup(dir);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Merges the leak reports of a process and the workers it forked, one
+// report per process, into one entry per stack.  A stack's pre-fork
+// column comes from the workers' INHERITED entries, blocks the parent
+// allocated before fork() that a worker still held, and shows the most
+// any worker held.  Every process then has a column of the blocks it
+// leaked itself.  Stacks match by their pcs, which fork() keeps.
+//
+// usage: smtmerge <report>...
+//   a report is named <program>.<pid>.memoryleak.<scope>, the output
+//   symbolizes with the maps of any of them:
+//   smtmerge ... > merged; smtsymbolize merged <report>.maps
+
+class Count {
+public:
+    Count()
+        : blocks(0)
+        , bytes(0)
+    {
+    }
+    long blocks;
+    long bytes;
+};
+
+class Stack {
+public:
+    Stack()
+        : prefork()
+        , inheritors(0)
+        , total(0)
+    {
+    }
+    std::string frames;
+    Count prefork;
+    int inheritors;
+    // own leaks by report
+    std::map<size_t, Count> own;
+    long total;
+};
+
+static bool stackgreater(const Stack* a, const Stack* b)
+{
+    if (a->total != b->total)
+        return a->total > b->total;
+    return a->frames < b->frames;
+}
+
+// <pid> from <dir>/<program>.<pid>.memoryleak.<scope>
+static std::string pidof(const char* path)
+{
+    std::string name(path);
+    size_t end = name.rfind(".memoryleak.");
+    if (end == std::string::npos)
+        return name;
+    size_t start = name.rfind('.', end - 1);
+    return name.substr(start == std::string::npos ? 0 : start + 1, end - (start == std::string::npos ? 0 : start + 1));
+}
+
+// the pcs of the frames, which identify a stack
+static std::string keyof(const std::string& frames)
+{
+    std::string key;
+    size_t pos = 0;
+    while (pos < frames.size()) {
+        size_t eol = frames.find('\n', pos);
+        size_t first = frames.find('\t', pos);
+        size_t second = first == std::string::npos ? first : frames.find('\t', first + 1);
+        if (second != std::string::npos && second < eol)
+            key += frames.substr(first + 1, second - first - 1) + "\n";
+        pos = eol == std::string::npos ? frames.size() : eol + 1;
+    }
+    return key;
+}
+
+int main(int argc, char* argv[])
+{
+    std::map<std::string, Stack> stacks;
+    std::vector<std::string> pids;
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <report>...\n", argv[0]);
+        return 1;
+    }
+    for (int r = 1; r < argc; r++) {
+        FILE* f = fopen(argv[r], "r");
+        if (!f) {
+            fprintf(stderr, "*** fail to open %s\n", argv[r]);
+            return 1;
+        }
+        size_t report = pids.size();
+        pids.push_back(pidof(argv[r]));
+        // an entry is a header line then its frames, up to the next header
+        char line[4096];
+        bool inherited = false;
+        Count count;
+        std::string frames;
+        bool more = true;
+        while (more) {
+            more = fgets(line, sizeof(line), f) != 0;
+            if (more && line[0] == '#') {
+                frames += line;
+                continue;
+            }
+            if (count.blocks) {
+                Stack& stack = stacks[keyof(frames)];
+                if (stack.frames.empty())
+                    stack.frames = frames;
+                if (inherited) {
+                    stack.prefork.blocks = std::max(stack.prefork.blocks, count.blocks);
+                    stack.prefork.bytes = std::max(stack.prefork.bytes, count.bytes);
+                    stack.inheritors++;
+                } else {
+                    stack.own[report].blocks += count.blocks;
+                    stack.own[report].bytes += count.bytes;
+                }
+            }
+            count = Count();
+            frames.clear();
+            const char* counts = more ? strstr(line, "][") : 0;
+            if (counts && sscanf(counts, "][%ld blocks, %ld bytes", &count.blocks, &count.bytes) == 2)
+                inherited = !strncmp(line, "INHERITED[", 10);
+            else
+                count = Count();
+        }
+        fclose(f);
+    }
+
+    std::vector<Stack*> sorted;
+    for (std::map<std::string, Stack>::iterator it = stacks.begin(); it != stacks.end(); ++it) {
+        Stack& stack = it->second;
+        stack.total = stack.prefork.bytes;
+        for (std::map<size_t, Count>::iterator own = stack.own.begin(); own != stack.own.end(); ++own)
+            stack.total += own->second.bytes;
+        sorted.push_back(&stack);
+    }
+    std::sort(sorted.begin(), sorted.end(), stackgreater);
+    printf("MERGED [%lu] reports into [%lu] stacks, pre-fork is the most any forked process still held\n",
+        pids.size(), sorted.size());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        const Stack& stack = *sorted[i];
+        printf("LEAK[%lu]", i + 1);
+        if (stack.inheritors)
+            printf("[pre-fork: up to %ld blocks, %ld bytes, in %d processes]", stack.prefork.blocks, stack.prefork.bytes,
+                stack.inheritors);
+        for (std::map<size_t, Count>::const_iterator own = stack.own.begin(); own != stack.own.end(); ++own)
+            printf("[pid %s: %ld blocks, %ld bytes]", pids[own->first].c_str(), own->second.blocks, own->second.bytes);
+        printf(" with BT:\n%s", stack.frames.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Run with libsimplemalloctrace.so in LD_PRELOAD.  Not linked with the
+// tracker: finds smtstart()/smtstop() at run time, leaks a known number of
+// blocks in a scope and checks that the scope's report counts them.
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LEAKS 3
+#define LEAKSZ 123
+
+typedef size_t (*SMTSTART_FUNCTION) (const char*, const char*, size_t);
+typedef void (*SMTSTOP_FUNCTION) (size_t, const char*, const char*, size_t);
+
+static void* leaked[LEAKS];
+
+static void __attribute__((noinline)) leak()
+{
+    for (int i = 0; i < LEAKS; i++)
+        leaked[i] = malloc(LEAKSZ);
+}
+
+static void __attribute__((noinline)) churn()
+{
+    for (int i = 0; i < 1000; i++) {
+        void* p = calloc(1, i + 1);
+        free(malloc(2 * i + 1));
+        free(p);
+    }
+}
+
+// whether some report of this process has line in it
+static int reported(const char* line)
+{
+    char prefix[64];
+    int found = 0;
+    snprintf(prefix, sizeof(prefix), "smtpreloadtest.%d.memoryleak.", getpid());
+    DIR* dir = opendir(".");
+    if (!dir)
+        return 0;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) || strchr(entry->d_name + strlen(prefix), '.'))
+            continue;
+        FILE* f = fopen(entry->d_name, "r");
+        if (!f)
+            continue;
+        char buf[1024];
+        while (!found && fgets(buf, sizeof(buf), f))
+            found = strstr(buf, line) != 0;
+        fclose(f);
+    }
+    closedir(dir);
+    return found;
+}
+
+int main()
+{
+    SMTSTART_FUNCTION start = (SMTSTART_FUNCTION)dlsym(RTLD_DEFAULT, "smtstart");
+    SMTSTOP_FUNCTION stop = (SMTSTOP_FUNCTION)dlsym(RTLD_DEFAULT, "smtstop");
+    if (!start || !stop) {
+        fprintf(stderr, "FAIL: libsimplemalloctrace.so is not preloaded\n");
+        return 1;
+    }
+    if (dlsym(RTLD_DEFAULT, "tr_where")) {
+        fprintf(stderr, "FAIL: tracker internals are exported\n");
+        return 1;
+    }
+    size_t scope = start(__FILE__, __FUNCTION__, __LINE__);
+    churn();
+    leak();
+    stop(scope, __FILE__, __FUNCTION__, __LINE__);
+
+    char line[128];
+    snprintf(line, sizeof(line), "[%d blocks, %d bytes, %d-%d bytes each,", LEAKS, LEAKS * LEAKSZ, LEAKSZ, LEAKSZ);
+    if (!reported(line)) {
+        fprintf(stderr, "FAIL: no report has %s\n", line);
+        return 1;
+    }
+    for (int i = 0; i < LEAKS; i++)
+        free(leaked[i]);
+    printf("PASS\n");
+    return 0;
+}
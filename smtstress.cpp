@@ -0,0 +1,842 @@
+#include <algorithm>
+#include <dirent.h>
+#include <malloc.h>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "SimpleMallocTrace.h"
+
+// Stress test of the tracker under CTest: worker threads do random mixes
+// of malloc, calloc, realloc, memalign, posix_memalign, aligned_alloc
+// and free, and hand blocks to each other to be freed on another thread.
+// Every block still held when a scope stops is a leak, and the scope's
+// report must count exactly those blocks and bytes.
+//
+// usage: smtstress threads|nested|fork|prefork|mismatch|sampling|firstsample [operations per thread]
+//
+//   threads  one scope per thread count, 1 to MAXTHREADS, printing the
+//            throughput of each
+//   nested   an outer scope, an inner one that frees half of the outer
+//            scope's leaks and leaks its own, and an empty one
+//   fork     forks while the workers allocate, every child checks a
+//            scope of its own
+//   prefork  forks workers from a scope holding known blocks, each frees
+//            some of them and leaks its own, its report of that scope
+//            must list them apart from what it inherited
+//   mismatch leaks blocks from operator new in a scope, and forks a
+//            child that frees blocks with the wrong function, its
+//            mismatch report at exit must count every pair
+//   sampling run with SMT_SAMPLE_INTERVAL set: a thread that has not
+//            sampled yet forks, parent and child leak the same blocks
+//            from the same stacks and must not sample the same ones
+//   firstsample run with SMT_SAMPLE_INTERVAL set: threads that make one
+//            small allocation each must not all be sampled
+
+#define MAXTHREADS 8
+#define SLOTS 512
+#define MAILBOX 256
+#define FORKS 8
+#define CHILDLEAKS 10
+#define PREFORK 40
+#define NEWLEAKS 12
+#define SAMPLESTACKS 8
+#define SAMPLELEAKS 2000
+#define FIRSTSAMPLES 64
+
+class Block {
+public:
+    void* p;
+    size_t sz;
+};
+
+enum Step {
+    // random operations on slots [first, last)
+    WORK,
+    // free the blocks other threads handed over
+    DRAIN,
+    // free every other block in slots [first, last)
+    HALVE,
+    // free everything
+    RELEASE,
+    QUIT
+};
+
+class Worker {
+public:
+    pthread_t id;
+    int index;
+    uint64_t seed;
+    Block slots[SLOTS];
+    pthread_mutex_t lock;
+    Block mailbox[MAILBOX];
+    int mailed;
+};
+
+static Worker workers[MAXTHREADS];
+static pthread_mutex_t steplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stepcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;
+static int generation = 0;
+static int done = 0;
+static Step step = WORK;
+static int active = 0;
+static size_t first = 0;
+static size_t last = SLOTS;
+static long operations = 20000;
+// more than malloc() ever gives, volatile so that the compiler does not
+// warn about asking for it
+static volatile size_t toobig = PTRDIFF_MAX;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t next(uint64_t* seed)
+{
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 0x2545F4914F6CDD1DULL;
+}
+
+// mostly small blocks, one in 64 big enough for mmap
+static size_t randomsize(uint64_t* seed)
+{
+    uint64_t r = next(seed);
+    if (!(r % 64))
+        return 128 * 1024 + (r >> 8) % (384 * 1024);
+    return 1 + (r >> 8) % 2048;
+}
+
+static Block allocate(uint64_t* seed)
+{
+    Block b;
+    uint64_t r = next(seed);
+    size_t alignment = (size_t)16 << ((r >> 8) % 9);
+    b.sz = randomsize(seed);
+    switch (r % 6) {
+    case 0:
+        b.p = malloc(b.sz);
+        break;
+    case 1: {
+        size_t nitems = 1 + (r >> 16) % 8;
+        b.sz = nitems * (b.sz / nitems + 1);
+        b.p = calloc(nitems, b.sz / nitems);
+        break;
+    }
+    case 2:
+        b.p = realloc(0, b.sz);
+        break;
+    case 3:
+        b.p = memalign(alignment, b.sz);
+        break;
+    case 4:
+        if (posix_memalign(&b.p, alignment, b.sz))
+            b.p = 0;
+        break;
+    default:
+        b.sz = (b.sz + alignment - 1) / alignment * alignment;
+        b.p = aligned_alloc(alignment, b.sz);
+        break;
+    }
+    if (!b.p)
+        b.sz = 0;
+    return b;
+}
+
+static void release(Block* b)
+{
+    free(b->p);
+    b->p = 0;
+    b->sz = 0;
+}
+
+static void drain(Worker* w)
+{
+    Block mail[MAILBOX];
+    pthread_mutex_lock(&w->lock);
+    int n = w->mailed;
+    memcpy(mail, w->mailbox, n * sizeof(Block));
+    w->mailed = 0;
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 0; i < n; i++)
+        release(&mail[i]);
+}
+
+static void work(Worker* w)
+{
+    for (long i = 0; i < operations; i++) {
+        uint64_t r = next(&w->seed);
+        Block* b = &w->slots[first + r % (last - first)];
+        switch ((r >> 32) % 10) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            release(b);
+            *b = allocate(&w->seed);
+            break;
+        case 4:
+        case 5:
+            release(b);
+            break;
+        case 6:
+        case 7:
+            if (b->p) {
+                // grows, shrinks, sometimes to 0 which frees it, or fails
+                // and leaves it as it was
+                size_t sz = (r >> 40) % 32 ? randomsize(&w->seed) : 0;
+                if ((r >> 40) % 32 == 1)
+                    sz = toobig;
+                void* p = realloc(b->p, sz);
+                if (p || !sz) {
+                    b->p = p;
+                    b->sz = p ? sz : 0;
+                }
+            }
+            break;
+        case 8:
+            if (b->p) {
+                Worker* to = &workers[(w->index + 1 + (r >> 40) % active) % active];
+                pthread_mutex_lock(&to->lock);
+                if (to->mailed < MAILBOX) {
+                    to->mailbox[to->mailed++] = *b;
+                    b->p = 0;
+                    b->sz = 0;
+                }
+                pthread_mutex_unlock(&to->lock);
+                release(b);
+            }
+            break;
+        default:
+            drain(w);
+            break;
+        }
+    }
+}
+
+static void* worker(void* arg)
+{
+    Worker* w = static_cast<Worker*>(arg);
+    int seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&steplock);
+        while (generation == seen)
+            pthread_cond_wait(&stepcond, &steplock);
+        seen = generation;
+        Step s = step;
+        int run = w->index < active;
+        pthread_mutex_unlock(&steplock);
+        if (s == QUIT)
+            return 0;
+        if (run) {
+            size_t i;
+            switch (s) {
+            case WORK:
+                work(w);
+                break;
+            case DRAIN:
+                drain(w);
+                break;
+            case HALVE:
+                for (i = first; i < last; i++) {
+                    if (w->slots[i].p && (i & 1))
+                        release(&w->slots[i]);
+                }
+                break;
+            default:
+                drain(w);
+                for (i = 0; i < SLOTS; i++)
+                    release(&w->slots[i]);
+                break;
+            }
+        }
+        pthread_mutex_lock(&steplock);
+        done++;
+        pthread_cond_signal(&donecond);
+        pthread_mutex_unlock(&steplock);
+    }
+}
+
+static void startstep(Step s, int threads, size_t from, size_t to)
+{
+    pthread_mutex_lock(&steplock);
+    step = s;
+    active = threads;
+    first = from;
+    last = to;
+    done = 0;
+    generation++;
+    pthread_cond_broadcast(&stepcond);
+    pthread_mutex_unlock(&steplock);
+}
+
+// whether the step finished, waiting for it if wait
+static int waitstep(int wait)
+{
+    pthread_mutex_lock(&steplock);
+    while (wait && done < MAXTHREADS)
+        pthread_cond_wait(&donecond, &steplock);
+    int finished = done == MAXTHREADS;
+    pthread_mutex_unlock(&steplock);
+    return finished;
+}
+
+static void runstep(Step s, int threads, size_t from, size_t to)
+{
+    startstep(s, threads, from, to);
+    waitstep(1);
+}
+
+// blocks and bytes held in slots [from, to) of every worker
+static void held(size_t from, size_t to, long* blocks, long* bytes)
+{
+    *blocks = 0;
+    *bytes = 0;
+    for (int t = 0; t < MAXTHREADS; t++) {
+        for (size_t i = from; i < to; i++) {
+            if (workers[t].slots[i].p) {
+                (*blocks)++;
+                *bytes += workers[t].slots[i].sz;
+            }
+        }
+    }
+}
+
+// Sum the entries of the leak reports this process wrote since the last
+// check, there is none when a scope leaks nothing, and remove them.
+// INHERITED entries, blocks a forked child got from its parent, are
+// summed apart.
+static int check(const char* scope, long blocks, long bytes, long inheritedblocks = 0, long inheritedbytes = 0)
+{
+    char prefix[64];
+    long reportedblocks = 0;
+    long reportedbytes = 0;
+    long reportedinheritedblocks = 0;
+    long reportedinheritedbytes = 0;
+    snprintf(prefix, sizeof(prefix), "smtstress.%d.memoryleak.", getpid());
+    DIR* dir = opendir(".");
+    if (!dir)
+        return 0;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)))
+            continue;
+        if (!strchr(entry->d_name + strlen(prefix), '.')) {
+            FILE* f = fopen(entry->d_name, "r");
+            char line[1024];
+            while (f && fgets(line, sizeof(line), f)) {
+                const char* counts = strstr(line, "][");
+                long n = 0, sz = 0;
+                if (line[0] == '#' || !counts || sscanf(counts, "][%ld blocks, %ld bytes", &n, &sz) != 2)
+                    continue;
+                if (!strncmp(line, "INHERITED[", 10)) {
+                    reportedinheritedblocks += n;
+                    reportedinheritedbytes += sz;
+                } else {
+                    reportedblocks += n;
+                    reportedbytes += sz;
+                }
+            }
+            if (f)
+                fclose(f);
+        }
+        unlink(entry->d_name);
+    }
+    closedir(dir);
+    int ok = reportedblocks == blocks && reportedbytes == bytes
+        && reportedinheritedblocks == inheritedblocks && reportedinheritedbytes == inheritedbytes;
+    fprintf(ok ? stdout : stderr, "%s %s: expected %ld blocks, %ld bytes, reported %ld blocks, %ld bytes",
+        ok ? "ok" : "FAIL", scope, blocks, bytes, reportedblocks, reportedbytes);
+    if (inheritedblocks || reportedinheritedblocks)
+        fprintf(ok ? stdout : stderr, ", inherited: expected %ld blocks, %ld bytes, reported %ld blocks, %ld bytes",
+            inheritedblocks, inheritedbytes, reportedinheritedblocks, reportedinheritedbytes);
+    fprintf(ok ? stdout : stderr, "\n");
+    fflush(stdout);
+    return ok;
+}
+
+static int threads()
+{
+    int ok = 1;
+    long blocks, bytes;
+    printf("threads,operations,seconds,ops_per_s,ops_per_s_per_thread\n");
+    for (int t = 1; t <= MAXTHREADS; t *= 2) {
+        size_t scope = smtstart(__FILE__, __FUNCTION__, __LINE__);
+        double before = now();
+        runstep(WORK, t, 0, SLOTS);
+        double elapsed = (now() - before) / 1e9;
+        runstep(DRAIN, t, 0, SLOTS);
+        smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+        held(0, SLOTS, &blocks, &bytes);
+        printf("%d,%ld,%.3f,%.0f,%.0f\n", t, t * operations, elapsed, t * operations / elapsed, operations / elapsed);
+        char name[32];
+        snprintf(name, sizeof(name), "%d threads", t);
+        ok &= check(name, blocks, bytes);
+        runstep(RELEASE, MAXTHREADS, 0, SLOTS);
+    }
+    return ok;
+}
+
+static int nested()
+{
+    int ok = 1;
+    long outerblocks, outerbytes, innerblocks, innerbytes;
+    size_t outer = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    runstep(WORK, MAXTHREADS, 0, SLOTS / 2);
+    runstep(DRAIN, MAXTHREADS, 0, SLOTS / 2);
+    size_t inner = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    // frees blocks of the outer scope only
+    runstep(HALVE, MAXTHREADS, 0, SLOTS / 2);
+    runstep(WORK, MAXTHREADS, SLOTS / 2, SLOTS);
+    runstep(DRAIN, MAXTHREADS, SLOTS / 2, SLOTS);
+    size_t empty = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    smtstop(empty, __FILE__, __FUNCTION__, __LINE__);
+    ok &= check("empty scope", 0, 0);
+    smtstop(inner, __FILE__, __FUNCTION__, __LINE__);
+    held(SLOTS / 2, SLOTS, &innerblocks, &innerbytes);
+    ok &= check("inner scope", innerblocks, innerbytes);
+    smtstop(outer, __FILE__, __FUNCTION__, __LINE__);
+    held(0, SLOTS, &outerblocks, &outerbytes);
+    ok &= check("outer scope", outerblocks, outerbytes);
+    runstep(RELEASE, MAXTHREADS, 0, SLOTS);
+    return ok;
+}
+
+// in a child forked while the workers allocate, which do not exist here
+static int child()
+{
+    void* leaked[CHILDLEAKS];
+    long bytes = 0;
+    size_t scope = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    for (int i = 0; i < CHILDLEAKS; i++) {
+        leaked[i] = malloc(100 + i);
+        bytes += 100 + i;
+        free(malloc(1000));
+    }
+    smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+    char name[32];
+    snprintf(name, sizeof(name), "child %d", getpid());
+    int ok = check(name, CHILDLEAKS, bytes);
+    for (int i = 0; i < CHILDLEAKS; i++)
+        free(leaked[i]);
+    return ok;
+}
+
+static int forks()
+{
+    int ok = 1;
+    long blocks, bytes;
+    pid_t children[FORKS];
+    int forked = 0;
+    size_t scope = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    startstep(WORK, MAXTHREADS, 0, SLOTS);
+    while (forked < FORKS) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (!pid)
+            _exit(child() ? 0 : 1);
+        if (pid > 0)
+            children[forked++] = pid;
+        if (waitstep(0))
+            break;
+        usleep(5000);
+    }
+    waitstep(1);
+    runstep(DRAIN, MAXTHREADS, 0, SLOTS);
+    smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+    held(0, SLOTS, &blocks, &bytes);
+    ok &= check("parent", blocks, bytes);
+    for (int i = 0; i < forked; i++) {
+        int status = 0;
+        if (waitpid(children[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "FAIL child %d\n", children[i]);
+            ok = 0;
+        }
+    }
+    printf("%d children forked while allocating\n", forked);
+    runstep(RELEASE, MAXTHREADS, 0, SLOTS);
+    return ok;
+}
+
+// a worker forked from the scope, which holds kept: it frees its share
+// of them, leaks its own and reports the scope
+static int preforked(size_t scope, void** kept, int worker)
+{
+    void* leaked[CHILDLEAKS];
+    long bytes = 0;
+    long inheritedblocks = 0;
+    long inheritedbytes = 0;
+    for (int i = 0; i < PREFORK; i++) {
+        if (i % FORKS == worker) {
+            free(kept[i]);
+        } else {
+            inheritedblocks++;
+            inheritedbytes += 200 + i;
+        }
+    }
+    for (int i = 0; i < CHILDLEAKS; i++) {
+        leaked[i] = malloc(100 + worker);
+        bytes += 100 + worker;
+    }
+    smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+    char name[32];
+    snprintf(name, sizeof(name), "worker %d", getpid());
+    int ok = check(name, CHILDLEAKS, bytes, inheritedblocks, inheritedbytes);
+    for (int i = 0; i < CHILDLEAKS; i++)
+        free(leaked[i]);
+    return ok;
+}
+
+static int prefork()
+{
+    int ok = 1;
+    void* kept[PREFORK];
+    long bytes = 0;
+    pid_t children[FORKS];
+    size_t scope = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    for (int i = 0; i < PREFORK; i++) {
+        kept[i] = malloc(200 + i);
+        bytes += 200 + i;
+    }
+    for (int i = 0; i < FORKS; i++) {
+        fflush(stdout);
+        children[i] = fork();
+        if (!children[i])
+            _exit(preforked(scope, kept, i) ? 0 : 1);
+    }
+    for (int i = 0; i < FORKS; i++) {
+        int status = 0;
+        if (children[i] < 0 || waitpid(children[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "FAIL worker %d\n", children[i]);
+            ok = 0;
+        }
+    }
+    smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+    ok &= check("parent", PREFORK, bytes);
+    for (int i = 0; i < PREFORK; i++)
+        free(kept[i]);
+    return ok;
+}
+
+// hides where p came from, the compiler warns about the mismatches
+// mismatched() makes on purpose
+static void* __attribute__((noinline)) opaque(void* p)
+{
+    return p;
+}
+
+// frees blocks with every wrong function, and as many with the right one
+static void mismatched()
+{
+    for (int i = 0; i < 3; i++) {
+        free(opaque(::operator new(16)));
+        ::operator delete(::operator new(16));
+    }
+    for (int i = 0; i < 4; i++) {
+        ::operator delete(opaque(malloc(16)));
+        free(malloc(16));
+    }
+    for (int i = 0; i < 5; i++) {
+        ::operator delete(opaque(::operator new[](16)));
+        ::operator delete[](::operator new[](16));
+    }
+    for (int i = 0; i < 6; i++) {
+        ::operator delete[](opaque(::operator new(16)));
+        ::operator delete(::operator new(16), 16);
+    }
+    for (int i = 0; i < 7; i++) {
+        ::operator delete(::operator new(16), 32);
+        ::operator delete[](::operator new[](16), 16);
+    }
+}
+
+// Count the entries of the mismatch report child wrote at exit against
+// the pairs mismatched() frees wrongly, and remove every report of it.
+static int checkmismatches(pid_t child)
+{
+    static const struct {
+        const char* pair;
+        long blocks;
+    } expected[] = {
+        { "allocated by new, freed by free/realloc", 3 },
+        { "allocated by malloc, freed by delete", 4 },
+        { "allocated by new[], freed by delete", 5 },
+        { "allocated by new, freed by delete[]", 6 },
+        { "allocated by new, freed by delete with the wrong size", 7 },
+    };
+    const size_t pairs = sizeof(expected) / sizeof(expected[0]);
+    long reported[pairs];
+    long others = 0;
+    char prefix[64];
+    int ok = 1;
+    memset(reported, 0, sizeof(reported));
+    snprintf(prefix, sizeof(prefix), "smtstress.%d.", child);
+    DIR* dir = opendir(".");
+    if (!dir)
+        return 0;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)))
+            continue;
+        if (!strcmp(entry->d_name + strlen(prefix), "mismatch")) {
+            FILE* f = fopen(entry->d_name, "r");
+            char line[1024];
+            while (f && fgets(line, sizeof(line), f)) {
+                const char* counts = strstr(line, "][");
+                long n = 0;
+                size_t i;
+                if (strncmp(line, "MISMATCH[", 9) || !counts || sscanf(counts, "][%ld blocks", &n) != 1)
+                    continue;
+                // delete] must not match delete[] or a wrong size
+                for (i = 0; i < pairs; i++) {
+                    char match[128];
+                    snprintf(match, sizeof(match), "%s]", expected[i].pair);
+                    if (strstr(line, match))
+                        break;
+                }
+                if (i < pairs)
+                    reported[i] += n;
+                else
+                    others += n;
+            }
+            if (f)
+                fclose(f);
+        }
+        unlink(entry->d_name);
+    }
+    closedir(dir);
+    for (size_t i = 0; i < pairs; i++) {
+        int pairok = reported[i] == expected[i].blocks;
+        fprintf(pairok ? stdout : stderr, "%s %s: expected %ld blocks, reported %ld\n", pairok ? "ok" : "FAIL",
+            expected[i].pair, expected[i].blocks, reported[i]);
+        ok &= pairok;
+    }
+    if (others) {
+        fprintf(stderr, "FAIL %ld blocks reported for other pairs\n", others);
+        ok = 0;
+    }
+    fflush(stdout);
+    return ok;
+}
+
+static int mismatch()
+{
+    int ok = 1;
+    void* leaked[NEWLEAKS];
+    long bytes = 0;
+    size_t scope = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    for (int i = 0; i < NEWLEAKS; i++) {
+        leaked[i] = i % 2 ? ::operator new(100 + i) : ::operator new[](100 + i);
+        bytes += 100 + i;
+        // freed right, not leaked
+        delete new Block();
+        delete[] new Block[i + 1];
+    }
+    smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+    ok &= check("new", NEWLEAKS, bytes);
+    for (int i = 0; i < NEWLEAKS; i++) {
+        if (i % 2)
+            ::operator delete(leaked[i]);
+        else
+            ::operator delete[](leaked[i]);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (!pid) {
+        mismatched();
+        // the report is written at exit
+        exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "FAIL child %d\n", pid);
+        return 0;
+    }
+    ok &= checkmismatches(pid);
+    return ok;
+}
+
+static void* sampled[SAMPLESTACKS][SAMPLELEAKS];
+
+// SAMPLELEAKS blocks from a stack of its own for each depth, the
+// recursion is not a tail call
+static int __attribute__((noinline)) leakfrom(int depth, void** leaked)
+{
+    if (depth)
+        return leakfrom(depth - 1, leaked) + 1;
+    for (int i = 0; i < SAMPLELEAKS; i++)
+        leaked[i] = malloc(16 + (i * 37) % 1024);
+    return 0;
+}
+
+// The block counts of the leak reports pid wrote, sorted, and remove
+// the reports.  Sampling the same blocks gives the same counts.
+static std::vector<long> sampledcounts(pid_t pid)
+{
+    std::vector<long> counts;
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "smtstress.%d.memoryleak.", pid);
+    DIR* dir = opendir(".");
+    if (!dir)
+        return counts;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)))
+            continue;
+        if (!strchr(entry->d_name + strlen(prefix), '.')) {
+            FILE* f = fopen(entry->d_name, "r");
+            char line[1024];
+            while (f && fgets(line, sizeof(line), f)) {
+                long n = 0;
+                if (!strncmp(line, "MEMORYLEAK[", 11) && strstr(line, "][")
+                    && sscanf(strstr(line, "]["), "][%ld blocks", &n) == 1)
+                    counts.push_back(n);
+            }
+            if (f)
+                fclose(f);
+        }
+        unlink(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(counts.begin(), counts.end());
+    return counts;
+}
+
+// Forks from a thread that has not sampled yet, whose sampling state
+// the child starts from.  Both processes leak the same blocks in a
+// scope opened just before, the child reports and exits.
+static void* sampledfork(void* arg)
+{
+    size_t scope = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    fflush(stdout);
+    pid_t pid = fork();
+    for (int d = 0; d < SAMPLESTACKS; d++)
+        leakfrom(d, sampled[d]);
+    smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+    if (!pid)
+        _exit(0);
+    *static_cast<pid_t*>(arg) = pid;
+    return 0;
+}
+
+static int sampling()
+{
+    pid_t pid = -1;
+    pthread_t id;
+    int status = 0;
+    pthread_create(&id, 0, sampledfork, &pid);
+    pthread_join(id, 0);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "FAIL child %d\n", pid);
+        return 0;
+    }
+    std::vector<long> parent = sampledcounts(getpid());
+    std::vector<long> child = sampledcounts(pid);
+    for (int d = 0; d < SAMPLESTACKS; d++) {
+        for (int i = 0; i < SAMPLELEAKS; i++)
+            free(sampled[d][i]);
+    }
+    long parentblocks = 0, childblocks = 0;
+    for (size_t i = 0; i < parent.size(); i++)
+        parentblocks += parent[i];
+    for (size_t i = 0; i < child.size(); i++)
+        childblocks += child[i];
+    // every block is reported when nothing is sampled
+    int ok = parentblocks && parentblocks < SAMPLESTACKS * SAMPLELEAKS && parent != child;
+    fprintf(ok ? stdout : stderr, "%s sampling: parent reported %ld blocks from %lu stacks, child %ld from %lu%s\n",
+        ok ? "ok" : "FAIL", parentblocks, parent.size(), childblocks, child.size(),
+        parent == child ? ", the same counts" : "");
+    return ok;
+}
+
+static void* firstsampled[FIRSTSAMPLES];
+static pthread_barrier_t firstbarrier;
+
+static void* firstsample(void* arg)
+{
+    pthread_barrier_wait(&firstbarrier);
+    *static_cast<void**>(arg) = malloc(16);
+    return 0;
+}
+
+// The first allocation of a thread is picked with the probability its
+// weight assumes, 16 bytes in 4096 about once in 256: when every thread
+// picked it, the report would count FIRSTSAMPLES blocks each weighted as
+// 256 of them.  The threads are created before the scope, what glibc
+// allocates for them would be sampled too.
+static int firstsamples()
+{
+    pthread_t ids[FIRSTSAMPLES];
+    pthread_barrier_init(&firstbarrier, 0, FIRSTSAMPLES + 1);
+    for (int t = 0; t < FIRSTSAMPLES; t++)
+        pthread_create(&ids[t], 0, firstsample, &firstsampled[t]);
+    size_t scope = smtstart(__FILE__, __FUNCTION__, __LINE__);
+    pthread_barrier_wait(&firstbarrier);
+    for (int t = 0; t < FIRSTSAMPLES; t++)
+        pthread_join(ids[t], 0);
+    smtstop(scope, __FILE__, __FUNCTION__, __LINE__);
+    pthread_barrier_destroy(&firstbarrier);
+    std::vector<long> counts = sampledcounts(getpid());
+    for (int t = 0; t < FIRSTSAMPLES; t++)
+        free(firstsampled[t]);
+    long blocks = 0;
+    for (size_t i = 0; i < counts.size(); i++)
+        blocks += counts[i];
+    int ok = blocks < FIRSTSAMPLES / 4;
+    fprintf(ok ? stdout : stderr, "%s firstsample: %ld of %d first allocations sampled\n",
+        ok ? "ok" : "FAIL", blocks, FIRSTSAMPLES);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    int ok = 0;
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s threads|nested|fork|prefork|mismatch|sampling|firstsample [operations per thread]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 2 && atol(argv[2]) > 0)
+        operations = atol(argv[2]);
+    // stdout's buffer would otherwise be allocated inside the first scope
+    printf("smtstress %s, %ld operations per thread\n", argv[1], operations);
+    // workers are started outside of every scope, what glibc allocates
+    // for a thread is not ours to report
+    for (int t = 0; t < MAXTHREADS; t++) {
+        workers[t].index = t;
+        workers[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+        pthread_mutex_init(&workers[t].lock, 0);
+        pthread_create(&workers[t].id, 0, worker, &workers[t]);
+    }
+    check("before", 0, 0);
+    if (!strcmp(argv[1], "threads"))
+        ok = threads();
+    else if (!strcmp(argv[1], "nested"))
+        ok = nested();
+    else if (!strcmp(argv[1], "fork"))
+        ok = forks();
+    else if (!strcmp(argv[1], "prefork"))
+        ok = prefork();
+    else if (!strcmp(argv[1], "mismatch"))
+        ok = mismatch();
+    else if (!strcmp(argv[1], "sampling"))
+        ok = sampling();
+    else if (!strcmp(argv[1], "firstsample"))
+        ok = firstsamples();
+    else
+        fprintf(stderr, "unknown test %s\n", argv[1]);
+    startstep(QUIT, 0, 0, SLOTS);
+    for (int t = 0; t < MAXTHREADS; t++)
+        pthread_join(workers[t].id, 0);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
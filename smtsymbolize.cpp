@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "Symbolize.h"
+
+// Symbolizes a leak report written by SimpleMallocTrace offline, with the
+// copy of /proc/self/maps written next to it.  Every distinct pc is
+// resolved once, in address order so that each object file is opened
+// and indexed once, and the report is printed again with the function
+// and file:line columns filled in.
+//
+// usage: smtsymbolize <report> [<maps>] [<dir>]
+//   <maps> defaults to <report>.maps
+//   <dir> is searched for the object files first, as a sysroot and then
+//   by base name, for reports from another machine
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// a "#<n>\t<pc>\t<object>\t<function>[\t<file:line>]" line of the report,
+// split at its tabs
+static bool parseframe(const std::string& line, void** pc, std::vector<std::string>* fields = 0)
+{
+    if (line.empty() || line[0] != '#')
+        return false;
+    size_t tab = line.find('\t');
+    if (tab == std::string::npos)
+        return false;
+    char* end = 0;
+    uintptr_t address = strtoull(line.c_str() + tab + 1, &end, 16);
+    if (end == line.c_str() + tab + 1)
+        return false;
+    *pc = reinterpret_cast<void*>(address);
+    if (fields) {
+        fields->clear();
+        size_t begin = 0;
+        for (;;) {
+            tab = line.find('\t', begin);
+            fields->push_back(line.substr(begin, tab == std::string::npos ? tab : tab - begin));
+            if (tab == std::string::npos)
+                break;
+            begin = tab + 1;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <report> [<maps>] [<dir>]\n", argv[0]);
+        return 1;
+    }
+    double before = now();
+    std::string mapspath = argc > 2 ? argv[2] : std::string(argv[1]) + ".maps";
+    const char* root = argc > 3 ? argv[3] : 0;
+
+    FILE* f = fopen(argv[1], "r");
+    if (!f) {
+        fprintf(stderr, "*** fail to open %s\n", argv[1]);
+        return 1;
+    }
+    std::vector<std::string> lines;
+    std::vector<void*> pcs;
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), f)) {
+        size_t len = strlen(buf);
+        if (len && buf[len - 1] == '\n')
+            buf[--len] = '\0';
+        lines.push_back(buf);
+        void* pc;
+        if (parseframe(lines.back(), &pc))
+            pcs.push_back(pc);
+    }
+    fclose(f);
+
+    WTF::SymbolizeSession session;
+    if (!session.LoadMaps(mapspath.c_str(), root)) {
+        fprintf(stderr, "*** fail to read %s\n", mapspath.c_str());
+        return 1;
+    }
+    // mappings are disjoint, so address order groups pcs by object
+    std::sort(pcs.begin(), pcs.end());
+    pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+    std::vector<std::string> functions(pcs.size());
+    std::vector<std::string> fileLines(pcs.size());
+    size_t resolved = 0;
+    for (size_t i = 0; i < pcs.size(); i++) {
+        // a return address, look up the call instruction before it
+        void* address = static_cast<char*>(pcs[i]) - 1;
+        if (session.Symbolize(address, buf, sizeof(buf))) {
+            functions[i] = buf;
+            resolved++;
+        }
+        int line;
+        if (session.SymbolizeLine(address, buf, sizeof(buf), &line)) {
+            char number[16];
+            snprintf(number, sizeof(number), ":%d", line);
+            fileLines[i] = std::string(buf) + number;
+        }
+    }
+
+    std::vector<std::string> fields;
+    for (size_t i = 0; i < lines.size(); i++) {
+        void* pc;
+        if (!parseframe(lines[i], &pc, &fields) || fields.size() < 4) {
+            printf("%s\n", lines[i].c_str());
+            continue;
+        }
+        size_t k = std::lower_bound(pcs.begin(), pcs.end(), pc) - pcs.begin();
+        if (!functions[k].empty())
+            fields[3] = functions[k];
+        if (!fileLines[k].empty()) {
+            fields.resize(4);
+            fields.push_back(fileLines[k]);
+        }
+        std::string out = fields[0];
+        for (size_t j = 1; j < fields.size(); j++)
+            out += "\t" + fields[j];
+        printf("%s\n", out.c_str());
+    }
+    fprintf(stderr, "resolved %lu of %lu pcs in %.3fs\n", resolved, pcs.size(), now() - before);
+    return 0;
+}
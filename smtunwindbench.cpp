@@ -0,0 +1,67 @@
+#include <execinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "FrameUnwind.h"
+
+// Measures the cost of capturing one stack with glibc backtrace() and
+// with fpbacktrace(), from the leaf of a call chain at least as deep as
+// the number of frames captured.
+//
+// usage: smtunwindbench [iterations]
+
+typedef int (*UNWIND_FUNCTION) (void**, int);
+
+static UNWIND_FUNCTION unwind = 0;
+static int capture = 0;
+static long iterations = 100000;
+static double elapsed = 0;
+static int captured = 0;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int __attribute__((noinline, noclone)) descend(int depth)
+{
+    if (depth > 0) {
+        int r = descend(depth - 1);
+        // keep the compiler from turning the recursion into a loop
+        __asm__ __volatile__("" : : "r"(&r) : "memory");
+        return r + 1;
+    }
+    void* bt[64];
+    double before = now();
+    for (long i = 0; i < iterations; i++)
+        captured = unwind(bt, capture);
+    elapsed = now() - before;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int depths[] = { 4, 10, 32 };
+    static const struct {
+        const char* name;
+        UNWIND_FUNCTION function;
+    } unwinders[] = {
+        { "backtrace", backtrace },
+        { "fp", fpbacktrace },
+    };
+    if (argc > 1)
+        iterations = atol(argv[1]);
+    printf("unwinder,depth,frames,ns_per_stack\n");
+    for (size_t u = 0; u < sizeof(unwinders) / sizeof(unwinders[0]); u++) {
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            unwind = unwinders[u].function;
+            capture = depths[d];
+            descend(depths[d]);
+            printf("%s,%d,%d,%.1f\n", unwinders[u].name, capture, captured, elapsed / iterations);
+        }
+    }
+    return 0;
+}